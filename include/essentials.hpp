@@ -2,9 +2,12 @@
 
 #include <iostream>
 #include <algorithm>
+#include <array>
 #include <chrono>
 #include <fstream>
 #include <numeric>
+#include <cmath>
+#include <limits>
 #include <random>
 #include <type_traits>
 #include <memory>
@@ -20,21 +23,38 @@
 #include <memory>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <exception>
+#include <cerrno>
+#include <charconv>
+#include <string_view>
 
 #ifdef __GNUG__
 #include <cxxabi.h>  // for name demangling
 #endif
 
-namespace essentials {
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#endif
 
-[[maybe_unused]] static void logger(std::string const& msg) {
-    time_t t = std::time(nullptr);
-    std::locale loc;
-    const std::time_put<char>& tp = std::use_facet<std::time_put<char>>(loc);
-    const char* fmt = "%F %T";
-    tp.put(std::cout, std::cout, ' ', std::localtime(&t), fmt, fmt + strlen(fmt));
-    std::cout << ": " << msg << std::endl;
-}
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>  // for hardware CRC32C
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // for rdtscp
+#endif
+
+namespace essentials {
 
 static const uint64_t GB = 1000 * 1000 * 1000;
 static const uint64_t GiB = uint64_t(1) << 30;
@@ -115,6 +135,881 @@ static void save_pod(std::ostream& os, T const& val) {
     os.write(reinterpret_cast<char const*>(&val), sizeof(T));
 }
 
+/* Read exactly num_bytes at the given file offset, retrying on short reads. */
+[[maybe_unused]] static void pread_all(int fd, void* data, size_t num_bytes, uint64_t offset) {
+    char* ptr = static_cast<char*>(data);
+    while (num_bytes != 0) {
+        ssize_t ret = ::pread(fd, ptr, num_bytes, static_cast<off_t>(offset));
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR) continue;
+            throw std::runtime_error("pread failed");
+        }
+        ptr += ret;
+        offset += ret;
+        num_bytes -= ret;
+    }
+}
+
+/*
+    O_DIRECT requires file offsets, sizes and buffer addresses aligned to the logical
+    block size of the device: 4 KiB is a multiple of it on all common devices.
+*/
+static const size_t direct_io_alignment = 4096;
+
+/*
+    Read exactly num_bytes at the given file offset from fd, opened with O_DIRECT.
+    Reads are issued on aligned blocks of the file. When data and offset are congruent
+    modulo direct_io_alignment (see contiguous_memory_allocator::io_options), the blocks
+    are read straight into data, and only the partial blocks at the ends of the range go
+    through bounce, an aligned buffer of bounce_bytes (a multiple of the alignment).
+    Otherwise, all blocks go through bounce. If the file system rejects a read with
+    EINVAL, the rest of the range is read from buffered_fd, the file opened without
+    O_DIRECT.
+*/
+[[maybe_unused]] static void pread_direct(int fd, int buffered_fd, void* data, size_t num_bytes,
+                                          uint64_t offset, char* bounce, size_t bounce_bytes) {
+    const uint64_t alignment = direct_io_alignment;
+
+    /* Read up to len bytes at pos into dest, fewer only at the end of the file.
+       Return false if O_DIRECT is not supported for this read. */
+    auto read_some = [fd](char* dest, uint64_t len, uint64_t pos, uint64_t& got) {
+        for (got = 0; got != len;) {
+            ssize_t ret = ::pread(fd, dest + got, len - got, static_cast<off_t>(pos + got));
+            if (ret == 0) break;
+            if (ret == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EINVAL) return false;
+                throw std::runtime_error("pread failed");
+            }
+            got += ret;
+        }
+        return true;
+    };
+
+    char* ptr = static_cast<char*>(data);
+    uint64_t end = offset + num_bytes;
+    bool congruent = reinterpret_cast<uintptr_t>(ptr) % alignment == offset % alignment;
+    uint64_t pos = offset - offset % alignment;
+    while (pos < end) {
+        uint64_t got = 0;
+        if (congruent && pos >= offset && end - pos >= alignment) {
+            uint64_t len = (end - pos) / alignment * alignment;
+            if (!read_some(ptr + (pos - offset), len, pos, got)) break;
+            if (got != len) throw std::runtime_error("unexpected end of file");
+            pos += len;
+            continue;
+        }
+        uint64_t len = congruent ? alignment
+                                 : std::min<uint64_t>(bounce_bytes, (end - pos + alignment - 1) /
+                                                                        alignment * alignment);
+        if (!read_some(bounce, len, pos, got)) break;
+        uint64_t from = std::max(pos, offset);
+        uint64_t to = std::min(pos + len, end);
+        if (pos + got < to) throw std::runtime_error("unexpected end of file");
+        std::memcpy(ptr + (from - offset), bounce + (from - pos), to - from);
+        pos += len;
+    }
+    if (pos < end) {
+        uint64_t from = std::max(pos, offset);
+        pread_all(buffered_fd, ptr + (from - offset), end - from, from);
+    }
+}
+
+/* Write exactly num_bytes at the given file offset, retrying on short writes. */
+[[maybe_unused]] static void pwrite_all(int fd, void const* data, size_t num_bytes,
+                                        uint64_t offset) {
+    char const* ptr = static_cast<char const*>(data);
+    while (num_bytes != 0) {
+        ssize_t ret = ::pwrite(fd, ptr, num_bytes, static_cast<off_t>(offset));
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR) continue;
+            throw std::runtime_error("pwrite failed");
+        }
+        ptr += ret;
+        offset += ret;
+        num_bytes -= ret;
+    }
+}
+
+/* Write exactly num_bytes at the current position of fd, retrying on short writes. */
+[[maybe_unused]] static void write_all(int fd, void const* data, size_t num_bytes) {
+    char const* ptr = static_cast<char const*>(data);
+    while (num_bytes != 0) {
+        ssize_t ret = ::write(fd, ptr, num_bytes);
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR) continue;
+            throw std::runtime_error("write failed");
+        }
+        ptr += ret;
+        num_bytes -= ret;
+    }
+}
+
+enum class log_level : uint8_t { debug, info, warning, error };
+
+/*
+    Asynchronous logger.
+    Producers copy each message, with its level and timestamp, into a bounded
+    lock-free ring of fixed-size slots and return immediately; a background
+    thread formats the messages (the timestamp string is cached and rebuilt
+    at most once per second) and writes them in batches, sleeping on a condition
+    variable while the ring is empty.
+    No message is lost by default: messages longer than max_message_bytes are
+    copied to the heap, and producers wait for a free slot when the ring is full.
+    With set_blocking(false), messages not fitting in a full ring are discarded
+    instead, as are the ones exceeding the rate limit (messages per second,
+    0 = unlimited): the number of dropped messages is reported in the output.
+*/
+struct async_logger {
+    static constexpr size_t max_message_bytes = 224;
+
+    /* Write to os, flushed after every batch. Lines are written whenever the
+       background thread wakes up, so they may interleave arbitrarily with other
+       output the program writes to os: call flush() before writing to os. */
+    async_logger(std::ostream& os = std::cout, size_t capacity = 1024)
+        : async_logger(-1, &os, capacity) {}
+
+    async_logger(int fd, size_t capacity = 1024)
+        : async_logger(fd, nullptr, capacity) {}
+
+    async_logger(async_logger const&) = delete;
+    async_logger& operator=(async_logger const&) = delete;
+
+    ~async_logger() {
+        m_stop.store(true, std::memory_order_release);
+        wake_consumer();
+        m_thread.join();
+    }
+
+    void set_level(log_level level) {
+        m_level.store(static_cast<uint8_t>(level), std::memory_order_relaxed);
+    }
+    log_level level() const { return static_cast<log_level>(m_level.load()); }
+
+    void set_rate_limit(uint64_t messages_per_second) {
+        m_rate_limit.store(messages_per_second, std::memory_order_relaxed);
+    }
+
+    /* Whether producers wait for a free slot when the ring is full (the default),
+       rather than dropping their message. */
+    void set_blocking(bool blocking) { m_blocking.store(blocking, std::memory_order_relaxed); }
+
+    /* Number of messages discarded because of the rate limit or of a full ring. */
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    void log(log_level level, std::string_view msg) {
+        if (static_cast<uint8_t>(level) < m_level.load(std::memory_order_relaxed)) return;
+        time_t now = std::time(nullptr);
+        if (!admit(now) || !push(level, now, msg)) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        /* wake the consumer to write the message, or to report the drop */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleeping.load(std::memory_order_relaxed)) wake_consumer();
+    }
+
+    /* Wait until all the messages logged so far have been written. */
+    void flush() {
+        uint64_t target = m_tail.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_progress.wait(lock, [&] { return m_written.load(std::memory_order_acquire) >= target; });
+    }
+
+private:
+    struct alignas(64) slot {
+        std::atomic<uint64_t> sequence;
+        time_t time;
+        std::string* spilled;  // the message, if longer than max_message_bytes
+        log_level level;
+        uint8_t length;
+        char text[max_message_bytes];
+    };
+
+    int m_fd;
+    std::ostream* m_os;  // if not null, written instead of m_fd
+    std::vector<slot> m_slots;
+    uint64_t m_mask;
+    std::atomic<uint8_t> m_level;
+    std::atomic<uint64_t> m_rate_limit;
+    std::atomic<bool> m_blocking;
+    std::atomic<time_t> m_window;
+    std::atomic<uint64_t> m_window_count;
+    std::atomic<uint64_t> m_dropped;
+    alignas(64) std::atomic<uint64_t> m_tail;  // next slot claimed by producers
+    alignas(64) std::atomic<uint64_t> m_written;  // messages written by the consumer
+    std::atomic<bool> m_sleeping;  // whether the consumer waits on m_wake
+    std::atomic<bool> m_stop;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;      // wakes the consumer
+    std::condition_variable m_progress;  // signalled by the consumer after every batch
+    std::thread m_thread;
+
+    async_logger(int fd, std::ostream* os, size_t capacity)
+        : m_fd(fd)
+        , m_os(os)
+        , m_slots(round_up_to_power_of_two(capacity))
+        , m_mask(m_slots.size() - 1)
+        , m_level(static_cast<uint8_t>(log_level::info))
+        , m_rate_limit(0)
+        , m_blocking(true)
+        , m_window(0)
+        , m_window_count(0)
+        , m_dropped(0)
+        , m_tail(0)
+        , m_written(0)
+        , m_sleeping(false)
+        , m_stop(false) {
+        for (size_t i = 0; i != m_slots.size(); ++i) m_slots[i].sequence.store(i);
+        m_thread = std::thread([this]() { run(); });
+    }
+
+    static size_t round_up_to_power_of_two(size_t n) {
+        size_t p = 2;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+    /* Fixed one-second window: approximate, but needs no locks. */
+    bool admit(time_t now) {
+        uint64_t limit = m_rate_limit.load(std::memory_order_relaxed);
+        if (limit == 0) return true;
+        time_t window = m_window.load(std::memory_order_relaxed);
+        if (window != now && m_window.compare_exchange_strong(window, now)) {
+            m_window_count.store(0, std::memory_order_relaxed);
+        }
+        return m_window_count.fetch_add(1, std::memory_order_relaxed) < limit;
+    }
+
+    /* Whether the slot at position pos is free for producers. */
+    bool writable(uint64_t pos) const {
+        uint64_t seq = m_slots[pos & m_mask].sequence.load(std::memory_order_acquire);
+        return static_cast<int64_t>(seq - pos) >= 0;
+    }
+
+    bool push(log_level level, time_t now, std::string_view msg) {
+        uint64_t pos = m_tail.load(std::memory_order_relaxed);
+        slot* s = nullptr;
+        while (true) {
+            s = &m_slots[pos & m_mask];
+            uint64_t seq = s->sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {  // full
+                if (!m_blocking.load(std::memory_order_relaxed)) return false;
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_progress.wait(lock, [&] { return writable(pos); });
+                pos = m_tail.load(std::memory_order_relaxed);
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        s->spilled = nullptr;
+        if (msg.size() > max_message_bytes) {
+            s->spilled = new std::string(msg);
+            s->length = 0;
+        } else {
+            std::memcpy(s->text, msg.data(), msg.size());
+            s->length = static_cast<uint8_t>(msg.size());
+        }
+        s->time = now;
+        s->level = level;
+        s->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    void wake_consumer() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_sleeping.store(false, std::memory_order_relaxed);
+        }
+        m_wake.notify_one();
+    }
+
+    void run() {
+        static constexpr char const* prefixes[] = {"[debug] ", "", "[warning] ", "[error] "};
+        std::string buffer;
+        time_t cached_time = -1;
+        char stamp[32] = {0};
+        auto format_time = [&](time_t t) {
+            if (t == cached_time) return;
+            struct tm tm;
+            localtime_r(&t, &tm);
+            strftime(stamp, sizeof(stamp), "%F %T", &tm);
+            cached_time = t;
+        };
+        auto published = [&](uint64_t pos) {
+            return m_slots[pos & m_mask].sequence.load(std::memory_order_acquire) == pos + 1;
+        };
+        uint64_t reported_dropped = 0;
+        uint64_t head = 0;
+        while (true) {
+            bool stop = m_stop.load(std::memory_order_acquire);
+            uint64_t begin = head;
+            for (; published(head); ++head) {
+                slot& s = m_slots[head & m_mask];
+                format_time(s.time);
+                buffer.append(stamp).append(": ");
+                buffer.append(prefixes[static_cast<uint8_t>(s.level)]);
+                if (s.spilled) {
+                    buffer.append(*s.spilled);
+                    delete s.spilled;
+                } else {
+                    buffer.append(s.text, s.length);
+                }
+                buffer.push_back('\n');
+                s.sequence.store(head + m_slots.size(), std::memory_order_release);
+            }
+            uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+            if (dropped != reported_dropped) {
+                format_time(std::time(nullptr));
+                buffer.append(stamp).append(": [logger] ");
+                buffer.append(std::to_string(dropped - reported_dropped));
+                buffer.append(" messages dropped\n");
+                reported_dropped = dropped;
+            }
+            if (!buffer.empty()) {
+                try {
+                    if (m_os) {
+                        m_os->write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                        m_os->flush();
+                    } else {
+                        write_all(m_fd, buffer.data(), buffer.size());
+                    }
+                } catch (...) {  // nowhere to report it
+                }
+                buffer.clear();
+            }
+            m_written.store(head, std::memory_order_release);
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_progress.notify_all();
+            if (head != begin) continue;
+            if (stop) break;
+            /* sleep, unless a producer published a message (or logged a drop) before
+               seeing m_sleeping set: see log() */
+            m_sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (published(head) || m_stop.load(std::memory_order_acquire) ||
+                m_dropped.load(std::memory_order_relaxed) != reported_dropped) {
+                m_sleeping.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            m_wake.wait(lock, [&] { return !m_sleeping.load(std::memory_order_relaxed); });
+        }
+    }
+};
+
+/*
+    The logger shared by the whole program, writing to std::cout.
+    Its lines are not ordered with the program's own std::cout output: call
+    flush_logger() before writing to std::cout to keep them in order.
+    The lines still queued are written at normal exit (return from main() or
+    std::exit()), but lost on abnormal exit (std::abort(), std::_Exit(), a crash
+    or a fatal signal). logger() must not be called during static destruction:
+    the default logger may already have been destroyed.
+*/
+inline async_logger& default_logger() {
+    static async_logger l;
+    return l;
+}
+
+[[maybe_unused]] static void logger(log_level level, std::string const& msg) {
+    default_logger().log(level, msg);
+}
+
+[[maybe_unused]] static void logger(std::string const& msg) { logger(log_level::info, msg); }
+
+/* Wait until all the lines passed to logger() so far have been written. */
+[[maybe_unused]] static void flush_logger() { default_logger().flush(); }
+
+/* A read or write of num_bytes at the given file offset. */
+template <typename Pointer>
+struct io_request {
+    Pointer data;
+    uint64_t offset;
+    uint64_t num_bytes;
+};
+
+/*
+    Call f(data, offset, num_bytes) for all requests using num_threads threads.
+    Requests are split into chunks of at most chunk_bytes, so that also a single
+    large request is spread across threads. The first exception thrown by f,
+    if any, is rethrown after all threads have joined.
+*/
+template <typename Pointer, typename F>
+static void parallel_io(std::vector<io_request<Pointer>> const& requests, size_t num_threads,
+                        F f, uint64_t chunk_bytes = 8 * MiB) {
+    std::vector<io_request<Pointer>> chunks;
+    for (auto const& r : requests) {
+        for (uint64_t i = 0; i < r.num_bytes; i += chunk_bytes) {
+            chunks.push_back({r.data + i, r.offset + i, std::min(chunk_bytes, r.num_bytes - i)});
+        }
+    }
+    num_threads = std::max<size_t>(1, std::min<size_t>(num_threads, chunks.size()));
+
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        for (size_t i = next++; i < chunks.size() && !failed; i = next++) {
+            try {
+                f(chunks[i].data, chunks[i].offset, chunks[i].num_bytes);
+            } catch (...) {
+                if (!failed.exchange(true)) error = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; ++t) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    if (error) std::rethrow_exception(error);
+}
+
+/*
+    A file read with pread() from several threads, straight into the destination
+    of each request (see parallel_io).
+    With direct set, the file is opened with O_DIRECT so that bulk reads bypass the
+    page cache, neither copying the data through it nor evicting the working set
+    of other processes (see pread_direct). The aligned bounce buffers this needs are
+    allocated once, one per thread, and reused by all reads. If the file system does
+    not support O_DIRECT (the open fails, e.g. with EINVAL), the file is read through
+    the page cache: see direct().
+*/
+struct pread_file {
+    pread_file(char const* filename, bool direct = false)
+        : m_fd(-1)
+        , m_buffered_fd(::open(filename, O_RDONLY)) {
+        if (m_buffered_fd == -1) {
+            throw std::runtime_error(
+                "Error in opening binary "
+                "file.");
+        }
+#ifdef O_DIRECT
+        if (direct) m_fd = ::open(filename, O_RDONLY | O_DIRECT);
+#endif
+    }
+
+    ~pread_file() {
+        if (m_fd != -1) ::close(m_fd);
+        ::close(m_buffered_fd);
+    }
+
+    pread_file(pread_file const&) = delete;
+    pread_file& operator=(pread_file const&) = delete;
+
+    /* Whether the file is read with O_DIRECT. */
+    bool direct() const { return m_fd != -1; }
+
+    void read(std::vector<io_request<char*>> const& requests, size_t num_threads) {
+        if (!direct()) {
+            int fd = m_buffered_fd;
+            parallel_io(requests, num_threads,
+                        [fd](char* data, uint64_t offset, uint64_t num_bytes) {
+                            pread_all(fd, data, num_bytes, offset);
+                        });
+            return;
+        }
+        parallel_io(requests, num_threads, [this](char* data, uint64_t offset, uint64_t num_bytes) {
+            bounce_buffer bounce = acquire_bounce();
+            try {
+                pread_direct(m_fd, m_buffered_fd, data, num_bytes, offset, bounce.get(),
+                             bounce_bytes);
+            } catch (...) {
+                release_bounce(std::move(bounce));
+                throw;
+            }
+            release_bounce(std::move(bounce));
+        });
+    }
+
+private:
+    typedef std::unique_ptr<char, decltype(&std::free)> bounce_buffer;
+    static constexpr size_t bounce_bytes = 1 * MiB;
+
+    int m_fd;  // opened with O_DIRECT, if supported and requested
+    int m_buffered_fd;
+    std::mutex m_mutex;
+    std::vector<bounce_buffer> m_bounce;  // free bounce buffers
+
+    bounce_buffer acquire_bounce() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_bounce.empty()) {
+                bounce_buffer b = std::move(m_bounce.back());
+                m_bounce.pop_back();
+                return b;
+            }
+        }
+        bounce_buffer b(static_cast<char*>(std::aligned_alloc(direct_io_alignment, bounce_bytes)),
+                        &std::free);
+        if (!b) throw std::bad_alloc();
+        return b;
+    }
+
+    void release_bounce(bounce_buffer b) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bounce.push_back(std::move(b));
+    }
+};
+
+/*
+    CRC32C (Castagnoli) checksum of n bytes, using the SSE4.2 or ARMv8 CRC
+    instructions when available. Checksums can be computed incrementally:
+    crc32c(b, nb, crc32c(a, na)) == crc32c of the concatenation of a and b.
+*/
+[[maybe_unused]] static uint32_t crc32c(void const* data, size_t n, uint32_t crc = 0) {
+    uint8_t const* p = static_cast<uint8_t const*>(data);
+    uint32_t state = ~crc;
+#if defined(__SSE4_2__)
+    uint64_t state64 = state;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        state64 = _mm_crc32_u64(state64, word);
+    }
+    state = static_cast<uint32_t>(state64);
+    for (; n != 0; --n, ++p) state = _mm_crc32_u8(state, *p);
+#elif defined(__ARM_FEATURE_CRC32)
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        state = __crc32cd(state, word);
+    }
+    for (; n != 0; --n, ++p) state = __crc32cb(state, *p);
+#else
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i != 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k != 8; ++k) c = (c >> 1) ^ (0x82F63B78 & (0u - (c & 1)));
+            t[i] = c;
+        }
+        return t;
+    }();
+    for (; n != 0; --n, ++p) state = table[(state ^ *p) & 0xFF] ^ (state >> 8);
+#endif
+    return ~state;
+}
+
+/*
+    Options controlling the binary format written by saver and read by loader,
+    mmap() and sizer. The same options must be used to save and load a file.
+
+    alignment: if 0 (default), the payload of a sequence immediately follows its
+    size. Otherwise, the payload of a sequence of T starts at an offset that is a
+    multiple of max(alignof(T), alignment), by padding with zero bytes after the size.
+    Offsets are counted from the beginning of the file, so that mmapped owning_spans
+    are aligned (up to the page size). Use 1 for the natural alignment of T and,
+    e.g., 64 to align payloads to cache lines. Must be 0 or a power of two.
+
+    header: if true, the file starts with a file_header recording the format
+    version, the alignment, a hash of the layout of the saved type, and the size and
+    CRC32C checksum of the payload. Loading checks the magic number, version and
+    layout hash in O(1), and the alignment is taken from the header.
+
+    verify_checksum: if true (and header is true), loading also recomputes the
+    checksum of the payload and throws if it does not match the one in the header.
+
+    compress: if true, sequences of integers are stored block-compressed (see
+    block_codec) rather than raw, and decoded when loading. Since the decoded
+    arrays cannot point into the file, mmap() decodes them to the heap.
+    If header is true, this option is recorded in the header.
+*/
+struct format_options {
+    size_t alignment = 0;
+    bool header = false;
+    bool verify_checksum = false;
+    bool compress = false;
+
+    void validate() const {
+        if ((alignment & (alignment - 1)) != 0) {
+            throw std::runtime_error("alignment must be 0 or a power of two");
+        }
+    }
+
+    /* Number of padding bytes to write before a payload of T at the given offset. */
+    template <typename T>
+    size_t padding(size_t offset) const {
+        if (alignment == 0) return 0;
+        size_t a = std::max(alignof(T), alignment);
+        return (a - offset % a) % a;
+    }
+};
+
+/*
+    Fixed-size header written at the beginning of a file when
+    format_options::header is set. Its size is a multiple of any
+    sensible alignment, so it does not shift aligned payloads.
+    The layout hash is built from typeid names, which differ between
+    compilers and standard libraries: a file saved with a header by a
+    GCC build fails check_layout() in a Clang (or MSVC) build, even
+    though its payload is the same. Save without a header to exchange
+    files between such builds.
+*/
+struct file_header {
+    static constexpr uint64_t magic_number = 0x534C41494E455353;  // "SSENIALS"
+    static constexpr uint8_t version_major = 1;
+    static constexpr uint8_t version_minor = 2;
+    static constexpr uint8_t version_patch = 0;
+
+    uint64_t magic;
+    uint8_t version[4];
+    uint32_t flags;  // since 1.2.0: flag_compressed
+    uint64_t alignment;
+    uint64_t layout_hash;
+    uint64_t payload_bytes;
+    uint32_t checksum;
+    uint32_t reserved32;
+    uint64_t arena_bytes;  // since 1.1.0: arena size for contiguous_memory_allocator
+    uint64_t reserved;
+
+    static constexpr uint32_t flag_compressed = 1;
+
+    static file_header make(size_t alignment, uint64_t layout_hash, uint64_t payload_bytes,
+                            uint32_t checksum, uint64_t arena_bytes, uint32_t flags = 0) {
+        file_header h;
+        std::memset(&h, 0, sizeof(h));
+        h.magic = magic_number;
+        h.version[0] = version_major;
+        h.version[1] = version_minor;
+        h.version[2] = version_patch;
+        h.flags = flags;
+        h.alignment = alignment;
+        h.layout_hash = layout_hash;
+        h.payload_bytes = payload_bytes;
+        h.checksum = checksum;
+        h.arena_bytes = arena_bytes;
+        return h;
+    }
+
+    bool has_arena_bytes() const { return version[0] == 1 && version[1] >= 1; }
+
+    /* Check magic number and version. */
+    void validate() const {
+        if (magic != magic_number) {
+            throw std::runtime_error("file_header: bad magic number (not an essentials file?)");
+        }
+        if (version[0] != version_major || version[1] > version_minor) {
+            throw std::runtime_error(
+                "file_header: unsupported format version " + std::to_string(version[0]) + '.' +
+                std::to_string(version[1]) + '.' + std::to_string(version[2]));
+        }
+        if ((flags & ~flag_compressed) != 0) {
+            throw std::runtime_error("file_header: unsupported flags");
+        }
+    }
+
+    bool compressed() const { return (flags & flag_compressed) != 0; }
+
+    void check_layout(uint64_t expected_layout_hash) const {
+        if (layout_hash != expected_layout_hash) {
+            throw std::runtime_error(
+                "file_header: layout hash mismatch (file saved from a different type?)");
+        }
+    }
+
+    void check_checksum(uint32_t computed_checksum) const {
+        if (checksum != computed_checksum) {
+            throw std::runtime_error("file_header: checksum mismatch (corrupted file?)");
+        }
+    }
+};
+static_assert(sizeof(file_header) == 64);
+static_assert(is_pod<file_header>::value);
+
+/* Number of bytes to skip before placing an array of T at its natural alignment
+   in the arena of a contiguous_memory_allocator, whose current size is offset. */
+template <typename T>
+static size_t arena_padding(size_t offset) {
+    return (alignof(T) - offset % alignof(T)) % alignof(T);
+}
+
+/*
+    Block compression of integer sequences, used when format_options::compress is set.
+
+    Values are split into blocks of block_size. Each block stores its first value,
+    then the differences between consecutive values, zigzag-encoded (so that
+    small negative differences are small too) and bit-packed with the minimum
+    width for the block. Sorted sequences, e.g., of IDs, thus take a few bits
+    per value. An encoding starts with a table of the byte offsets of the blocks,
+    so that blocks can be decoded independently: in parallel, or on demand.
+
+    Layout, in 64-bit little-endian words:
+        offsets[num_blocks(n)]
+        for each block: first value, width, packed differences
+*/
+struct block_codec {
+    static constexpr size_t block_size = 256;
+
+    template <typename T>
+    static constexpr bool compressible = std::is_integral<T>::value && !std::is_same<T, bool>::value;
+
+    static size_t num_blocks(size_t n) { return (n + block_size - 1) / block_size; }
+
+    /* Whether encoded_bytes can hold the table of offsets of n values. Unlike comparing
+       with num_blocks(n) * 8, this does not overflow for a corrupt n. */
+    static bool fits(size_t n, uint64_t encoded_bytes) {
+        return n / block_size + (n % block_size != 0) <= encoded_bytes / 8;
+    }
+
+    /* Number of bytes of the encoding of n values, computed without encoding them. */
+    template <typename T>
+    static size_t encoded_bytes(T const* data, size_t n) {
+        size_t bytes = num_blocks(n) * 8;
+        uint64_t z[block_size];
+        for (size_t begin = 0; begin < n; begin += block_size) {
+            size_t len = std::min(block_size, n - begin);
+            bytes += block_bytes(len, zigzag_deltas(data + begin, len, z));
+        }
+        return bytes;
+    }
+
+    template <typename T>
+    static void encode(T const* data, size_t n, std::vector<uint8_t>& out) {
+        out.assign(num_blocks(n) * 8, 0);
+        uint64_t z[block_size];
+        for (size_t block = 0, begin = 0; begin < n; ++block, begin += block_size) {
+            size_t len = std::min(block_size, n - begin);
+            uint64_t width = zigzag_deltas(data + begin, len, z);
+            uint64_t offset = out.size();
+            std::memcpy(out.data() + block * 8, &offset, 8);
+            out.resize(offset + block_bytes(len, width), 0);
+            uint8_t* p = out.data() + offset;
+            store_word(p, to_word(data[begin]));
+            store_word(p + 8, width);
+            p += 16;
+            for (size_t j = 0, pos = 0; width != 0 && j != len - 1; ++j, pos += width) {
+                size_t w = pos / 64, shift = pos % 64;
+                store_word(p + 8 * w, load_word(p + 8 * w) | (z[j] << shift));
+                if (shift + width > 64) {
+                    store_word(p + 8 * (w + 1), z[j] >> (64 - shift));
+                }
+            }
+        }
+    }
+
+    /* Decode the given block of the encoding of n values into out. */
+    template <typename T>
+    static void decode_block(uint8_t const* encoded, size_t encoded_bytes, size_t n,
+                             size_t block, T* out) {
+        size_t len = std::min(block_size, n - block * block_size);
+        uint64_t offset = load_word(encoded + block * 8);
+        if (offset > encoded_bytes) corrupted();
+        decode_block_at(encoded + offset, encoded_bytes - offset, len, out);
+    }
+
+    static constexpr size_t block_header_bytes = 16;
+    static constexpr size_t max_block_bytes = block_header_bytes + 8 * (block_size - 1);
+
+    /* Number of bytes of a block of len values, given its header. */
+    static size_t block_bytes(uint8_t const* header, size_t len) {
+        uint64_t width = load_word(header + 8);
+        if (width > 64) corrupted();
+        return block_bytes(len, width);
+    }
+
+    /* Decode the block of len values at p, followed by at least num_bytes bytes. */
+    template <typename T>
+    static void decode_block_at(uint8_t const* p, size_t num_bytes, size_t len, T* out) {
+        if (num_bytes < block_header_bytes || num_bytes < block_bytes(p, len)) corrupted();
+        uint64_t value = load_word(p);
+        uint64_t width = load_word(p + 8);
+        p += block_header_bytes;
+
+        constexpr uint64_t mask = value_mask<T>();
+        out[0] = from_word<T>(value);
+        if (width == 0) {  // constant block
+            std::fill(out + 1, out + len, out[0]);
+            return;
+        }
+        uint64_t width_mask = width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+        for (size_t j = 1, pos = 0; j != len; ++j, pos += width) {
+            size_t w = pos / 64, shift = pos % 64;
+            uint64_t z = load_word(p + 8 * w) >> shift;
+            if (shift + width > 64) z |= load_word(p + 8 * (w + 1)) << (64 - shift);
+            z &= width_mask;
+            value = (value + ((z >> 1) ^ (0 - (z & 1)))) & mask;
+            out[j] = from_word<T>(value);
+        }
+    }
+
+    /* Decode n values into out, spreading blocks over num_threads threads. */
+    template <typename T>
+    static void decode(uint8_t const* encoded, size_t encoded_bytes, T* out, size_t n,
+                       size_t num_threads = 1) {
+        if (!fits(n, encoded_bytes)) corrupted();
+        if (num_threads <= 1 || n <= blocks_per_task * block_size) {
+            for (size_t block = 0; block != num_blocks(n); ++block) {
+                decode_block(encoded, encoded_bytes, n, block, out + block * block_size);
+            }
+            return;
+        }
+        /* parallel_io splits [0, n) into ranges of whole blocks */
+        std::vector<io_request<T*>> all = {{out, 0, n}};
+        parallel_io(
+            all, num_threads,
+            [&](T* data, uint64_t begin, uint64_t count) {
+                for (uint64_t i = 0; i < count; i += block_size) {
+                    decode_block(encoded, encoded_bytes, n, (begin + i) / block_size, data + i);
+                }
+            },
+            blocks_per_task * block_size);
+    }
+
+private:
+    static constexpr size_t blocks_per_task = 256;
+
+    [[noreturn]] static void corrupted() {
+        throw std::runtime_error("block_codec: corrupted encoding");
+    }
+
+    static size_t block_bytes(size_t len, uint64_t width) {
+        return block_header_bytes + (((len - 1) * width + 63) / 64) * 8;
+    }
+
+    static uint64_t load_word(uint8_t const* p) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        return word;
+    }
+
+    static void store_word(uint8_t* p, uint64_t word) { std::memcpy(p, &word, 8); }
+
+    template <typename T>
+    static constexpr uint64_t value_mask() {
+        return sizeof(T) == 8 ? ~uint64_t(0) : (uint64_t(1) << (8 * sizeof(T))) - 1;
+    }
+
+    template <typename T>
+    static uint64_t to_word(T value) {
+        return static_cast<uint64_t>(static_cast<std::make_unsigned_t<T>>(value));
+    }
+
+    template <typename T>
+    static T from_word(uint64_t word) {
+        return static_cast<T>(static_cast<std::make_unsigned_t<T>>(word));
+    }
+
+    /* Write the zigzag-encoded differences of the len values into z and return their width. */
+    template <typename T>
+    static uint64_t zigzag_deltas(T const* data, size_t len, uint64_t* z) {
+        constexpr uint64_t mask = value_mask<T>();
+        uint64_t all = 0;
+        for (size_t j = 1; j != len; ++j) {
+            uint64_t delta = (to_word(data[j]) - to_word(data[j - 1])) & mask;
+            uint64_t sign = (delta >> (8 * sizeof(T) - 1)) & 1;
+            z[j - 1] = ((delta << 1) & mask) ^ ((0 - sign) & mask);
+            all |= z[j - 1];
+        }
+        uint64_t width = 0;
+        while (width != 64 && (all >> width) != 0) ++width;
+        return width;
+    }
+};
+
 /*
     A read-only span with optional shared ownership.
     After construction, only const access is permitted.
@@ -195,240 +1090,2637 @@ struct is_owning_span<owning_span<T>> : std::true_type {};
 template <typename T>
 inline constexpr bool is_owning_span_v = is_owning_span<T>::value;
 
-struct json_lines {
-    struct property {
-        property(std::string n, std::string v)
-            : name(n)
-            , value(v) {}
+/*
+    A read-only array of integers kept block-compressed (see block_codec), for
+    random access without decompressing the whole array.
+    Blocks are decoded on first access into a cache of at most cache_blocks blocks,
+    shared by the copies of the span, so that memory is bounded by the cache rather
+    than by the size of the array. The cache is thread-safe: it is split into shards,
+    each with its own lock, evicting blocks with the CLOCK policy.
+    Iterators decode blocks into a private buffer instead, so that sequential scans
+    do not go through (and evict) the cache.
+
+    It is always serialized compressed, in the format of compressed sequences,
+    and mmap() makes it point into the mapped file.
+*/
+template <typename T>
+struct compressed_span {
+    static_assert(block_codec::compressible<T>, "compressed_span requires an integer type");
 
-        std::string name;
-        std::string value;
-    };
+    using value_type = T;
+    using size_type = size_t;
 
-    void new_line() { m_properties.push_back(std::vector<property>()); }
+    static constexpr size_t block_size = block_codec::block_size;
+    static constexpr size_t default_cache_blocks = 1024;
+
+    struct const_iterator {
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = T;
+
+        const_iterator(compressed_span const* span, size_t i)
+            : m_span(span)
+            , m_i(i)
+            , m_block(-1) {}
+
+        T operator*() const {
+            size_t block = m_i / block_size;
+            if (block != m_block) {
+                m_values.resize(block_size);
+                m_span->decode_block(block, m_values.data());
+                m_block = block;
+            }
+            return m_values[m_i % block_size];
+        }
 
-    template <typename T>
-    void add(std::string name, T value) {
-        if (!m_properties.size()) {
-            new_line();
+        const_iterator& operator++() {
+            ++m_i;
+            return *this;
         }
-        if constexpr (std::is_same<T, char const*>::value) {
-            m_properties.back().emplace_back(name, value);
-        } else if constexpr (std::is_same<T, bool>::value) {
-            m_properties.back().emplace_back(name, value ? "true" : "false");
-        } else {
-            m_properties.back().emplace_back(name, std::to_string(value));
+
+        const_iterator operator++(int) {
+            const_iterator it = *this;
+            ++m_i;
+            return it;
         }
-    }
 
-    void save_to_file(char const* filename) const {
-        std::ofstream out(filename);
+        bool operator==(const_iterator const& other) const { return m_i == other.m_i; }
+        bool operator!=(const_iterator const& other) const { return m_i != other.m_i; }
+
+    private:
+        compressed_span const* m_span;
+        size_t m_i;
+        mutable size_t m_block;
+        mutable std::vector<T> m_values;
+    };
+
+    compressed_span() = default;
+
+    /* Compress n values. */
+    compressed_span(T const* data, size_t n, size_t cache_blocks = default_cache_blocks)
+        : m_size(n) {
+        auto encoded = std::make_shared<std::vector<uint8_t>>();
+        block_codec::encode(data, n, *encoded);
+        m_encoded_bytes = encoded->size();
+        uint8_t const* ptr = encoded->data();
+        m_encoded = std::shared_ptr<const uint8_t[]>(std::move(encoded), ptr);
+        set_cache_blocks(cache_blocks);
+    }
+
+    compressed_span(std::vector<T> const& values, size_t cache_blocks = default_cache_blocks)
+        : compressed_span(values.data(), values.size(), cache_blocks) {}
+
+    /* View into an existing encoding of n values, optionally keeping owner alive. */
+    compressed_span(uint8_t const* encoded, size_t encoded_bytes, size_t n,
+                    std::shared_ptr<const void> owner = {},
+                    size_t cache_blocks = default_cache_blocks)
+        : m_encoded(std::move(owner), encoded)
+        , m_encoded_bytes(encoded_bytes)
+        , m_size(n) {
+        if (!block_codec::fits(n, encoded_bytes)) {
+            throw std::runtime_error("compressed_span: encoding too short");
+        }
+        set_cache_blocks(cache_blocks);
+    }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    T operator[](size_t i) const {
+        assert(i < m_size);
+        T value;
+        with_block(i / block_size, [&](T const* values) { value = values[i % block_size]; });
+        return value;
+    }
+
+    T front() const { return (*this)[0]; }
+    T back() const { return (*this)[m_size - 1]; }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, m_size); }
+
+    /*
+        out[j] = (*this)[indices[j]] for all j < k. Indices are grouped by block,
+        so that every block is looked up in the cache once per call.
+    */
+    void gather(size_t const* indices, size_t k, T* out) const {
+        std::vector<size_t> order(k);
+        std::iota(order.begin(), order.end(), 0);
+        if (!std::is_sorted(indices, indices + k)) {
+            std::sort(order.begin(), order.end(),
+                      [&](size_t a, size_t b) { return indices[a] < indices[b]; });
+        }
+        for (size_t i = 0; i != k;) {
+            size_t block = indices[order[i]] / block_size;
+            with_block(block, [&](T const* values) {
+                for (; i != k && indices[order[i]] / block_size == block; ++i) {
+                    assert(indices[order[i]] < m_size);
+                    out[order[i]] = values[indices[order[i]] % block_size];
+                }
+            });
+        }
+    }
+
+    std::vector<T> gather(std::vector<size_t> const& indices) const {
+        std::vector<T> out(indices.size());
+        gather(indices.data(), indices.size(), out.data());
+        return out;
+    }
+
+    /* Decode all values into out, using num_threads threads. */
+    void decode(T* out, size_t num_threads = 1) const {
+        block_codec::decode(m_encoded.get(), m_encoded_bytes, out, m_size, num_threads);
+    }
+
+    /* Replace the cache with an empty one of the given capacity.
+       Not safe while other threads access the span or its copies. */
+    void set_cache_blocks(size_t cache_blocks) {
+        m_cache = std::make_shared<cache>(std::max<size_t>(cache_blocks, 1));
+    }
+
+    size_t cache_blocks() const { return m_cache ? m_cache->capacity : 0; }
+    uint64_t cache_hits() const { return m_cache ? m_cache->hits.load() : 0; }
+    uint64_t cache_misses() const { return m_cache ? m_cache->misses.load() : 0; }
+
+    uint8_t const* encoded() const { return m_encoded.get(); }
+    size_t encoded_bytes() const { return m_encoded_bytes; }
+
+private:
+    struct cache {
+        static constexpr size_t max_shards = 16;
+
+        struct shard {
+            std::mutex mutex;
+            std::unordered_map<size_t, size_t> slot_of_block;
+            std::vector<size_t> block_of_slot;
+            std::vector<uint8_t> referenced;
+            std::vector<T> values;  // block_size values per slot
+            size_t capacity = 0;
+            size_t hand = 0;
+        };
+
+        cache(size_t cache_blocks)
+            : capacity(cache_blocks)
+            , shards(std::min(cache_blocks, max_shards))
+            , hits(0)
+            , misses(0) {
+            for (size_t i = 0; i != shards.size(); ++i) {
+                shards[i].capacity = cache_blocks / shards.size() + (i < cache_blocks % shards.size());
+            }
+        }
+
+        size_t capacity;
+        std::vector<shard> shards;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+    };
+
+    std::shared_ptr<const uint8_t[]> m_encoded;
+    size_t m_encoded_bytes = 0;
+    size_t m_size = 0;
+    std::shared_ptr<cache> m_cache;
+
+    void decode_block(size_t block, T* out) const {
+        block_codec::decode_block(m_encoded.get(), m_encoded_bytes, m_size, block, out);
+    }
+
+    /* Call f with the decoded values of the block, while holding the lock of its shard. */
+    template <typename F>
+    void with_block(size_t block, F f) const {
+        auto& c = *m_cache;
+        auto& s = c.shards[block % c.shards.size()];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        size_t slot;
+        auto it = s.slot_of_block.find(block);
+        if (it != s.slot_of_block.end()) {
+            slot = it->second;
+            c.hits.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            c.misses.fetch_add(1, std::memory_order_relaxed);
+            if (s.block_of_slot.size() < s.capacity) {
+                slot = s.block_of_slot.size();
+                s.block_of_slot.push_back(-1);
+                s.referenced.push_back(0);
+                s.values.resize(s.values.size() + block_size);
+            } else {
+                /* CLOCK: give referenced blocks a second chance */
+                while (s.referenced[s.hand]) {
+                    s.referenced[s.hand] = 0;
+                    s.hand = (s.hand + 1) % s.capacity;
+                }
+                slot = s.hand;
+                s.hand = (s.hand + 1) % s.capacity;
+                s.slot_of_block.erase(s.block_of_slot[slot]);
+                s.block_of_slot[slot] = -1;
+            }
+            decode_block(block, s.values.data() + slot * block_size);
+            s.block_of_slot[slot] = block;
+            s.slot_of_block.emplace(block, slot);
+        }
+        s.referenced[slot] = 1;
+        f(s.values.data() + slot * block_size);
+    }
+};
+
+/*
+    A read-only sequence of arrays of PODs of different sizes ("vector of vectors"),
+    stored flattened: the values of all arrays, one after the other, and the offset
+    of each array in them. Unlike an owning_span of owning_spans, it is serialized
+    as two arrays of PODs, so that mmap() makes it point into the mapped file
+    without copying, whatever the number of arrays. Loading checks that the offsets
+    start at 0, are non-decreasing and end at the number of values, so that a corrupt
+    file can not make operator[] read out of bounds.
+    Arrays are returned as un-owned owning_spans, valid as long as the jagged_span.
+*/
+template <typename T>
+struct jagged_span {
+    static_assert(is_pod<T>::value, "jagged_span requires a POD type");
+
+    using value_type = owning_span<T>;
+    using size_type = size_t;
+
+    struct const_iterator {
+        using iterator_category = std::input_iterator_tag;
+        using value_type = owning_span<T>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = owning_span<T>;
+
+        const_iterator(jagged_span const* span, size_t i)
+            : m_span(span)
+            , m_i(i) {}
+
+        owning_span<T> operator*() const { return (*m_span)[m_i]; }
+
+        const_iterator& operator++() {
+            ++m_i;
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator it = *this;
+            ++m_i;
+            return it;
+        }
+
+        bool operator==(const_iterator const& other) const { return m_i == other.m_i; }
+        bool operator!=(const_iterator const& other) const { return m_i != other.m_i; }
+
+    private:
+        jagged_span const* m_span;
+        size_t m_i;
+    };
+
+    struct builder {
+        builder()
+            : m_offsets(1, 0) {}
+
+        void reserve(size_t num_arrays, size_t num_values) {
+            m_offsets.reserve(num_arrays + 1);
+            m_data.reserve(num_values);
+        }
+
+        void push_back(T const* data, size_t n) {
+            m_data.insert(m_data.end(), data, data + n);
+            m_offsets.push_back(m_data.size());
+        }
+
+        template <typename Range>
+        void push_back(Range const& r) {
+            push_back(r.data(), r.size());
+        }
+
+        void build(jagged_span& j) {
+            j.m_offsets = std::move(m_offsets);
+            j.m_data = std::move(m_data);
+            m_offsets.assign(1, 0);
+            m_data.clear();
+        }
+
+    private:
+        std::vector<uint64_t> m_offsets;
+        std::vector<T> m_data;
+    };
+
+    jagged_span() = default;
+
+    template <typename Allocator>
+    jagged_span(std::vector<std::vector<T, Allocator>> const& arrays) {
+        builder b;
+        size_t num_values = 0;
+        for (auto const& a : arrays) num_values += a.size();
+        b.reserve(arrays.size(), num_values);
+        for (auto const& a : arrays) b.push_back(a);
+        b.build(*this);
+    }
+
+    /* Number of arrays. */
+    size_t size() const { return m_offsets.empty() ? 0 : m_offsets.size() - 1; }
+    bool empty() const { return size() == 0; }
+
+    owning_span<T> operator[](size_t i) const {
+        assert(i < size());
+        return owning_span<T>(m_data.data() + m_offsets[i], m_offsets[i + 1] - m_offsets[i]);
+    }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size()); }
+
+    /* The values of all arrays, and the offset of each array in them. */
+    owning_span<T> const& values() const { return m_data; }
+    owning_span<uint64_t> const& offsets() const { return m_offsets; }
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) {
+        visitor.visit(m_offsets);
+        visitor.visit(m_data);
+        check_offsets();
+    }
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) const {
+        visitor.visit(m_offsets);
+        visitor.visit(m_data);
+    }
+
+private:
+    owning_span<uint64_t> m_offsets;
+    owning_span<T> m_data;
+
+    void check_offsets() const {
+        bool valid = m_offsets.empty() ? m_data.empty()
+                                       : m_offsets.front() == 0 && m_offsets.back() == m_data.size();
+        for (size_t i = 1; valid && i < m_offsets.size(); ++i) {
+            valid = m_offsets[i - 1] <= m_offsets[i];
+        }
+        if (!valid) throw std::runtime_error("jagged_span: offsets do not match the values");
+    }
+};
+
+/*
+    Visitor computing a fingerprint of the layout of a type: the (mangled) names
+    and sizes of the visited types, in visit order. It does not depend on the
+    content of the visited object, so it can be computed on an empty object
+    before loading into it. It visits through the constness of the object it is
+    given, so a type with only a non-const visit() can be hashed before a load.
+    Names are compiler-specific (see file_header).
+*/
+struct layout_hasher {
+    template <typename T>
+    void visit(T& val) {
+        using type = std::remove_const_t<T>;
+        mix<type>();
+        if constexpr (is_pod<type>::value) {
+            m_hash = (m_hash ^ sizeof(type)) * fnv_prime;
+        } else if constexpr (!is_sequence<type>::value) {
+            val.visit(*this);
+        }
+        // The name of a sequence encodes its element type, so elements are not visited.
+    }
+
+    uint64_t hash() const { return m_hash; }
+
+private:
+    static constexpr uint64_t fnv_prime = 0x100000001B3;
+    uint64_t m_hash = 0xCBF29CE484222325;  // FNV-1a
+
+    template <typename T>
+    struct is_sequence : std::false_type {};
+    template <typename T, typename Allocator>
+    struct is_sequence<std::vector<T, Allocator>> : std::true_type {};
+    template <typename T>
+    struct is_sequence<owning_span<T>> : std::true_type {};
+    template <typename T>
+    struct is_sequence<compressed_span<T>> : std::true_type {};
+
+    template <typename T>
+    void mix() {
+        for (char const* p = typeid(T).name(); *p; ++p) {
+            m_hash = (m_hash ^ static_cast<uint8_t>(*p)) * fnv_prime;
+        }
+    }
+};
+
+template <typename T>
+static uint64_t layout_hash(T&& data_structure) {
+    layout_hasher h;
+    h.visit(data_structure);
+    return h.hash();
+}
+
+struct json_lines {
+    struct property {
+        property(std::string n, std::string v)
+            : name(n)
+            , value(v) {}
+
+        std::string name;
+        std::string value;
+    };
+
+    void new_line() { m_properties.push_back(std::vector<property>()); }
+
+    template <typename T>
+    void add(std::string name, T value) {
+        if (!m_properties.size()) {
+            new_line();
+        }
+        if constexpr (std::is_same<T, char const*>::value) {
+            m_properties.back().emplace_back(name, value);
+        } else if constexpr (std::is_same<T, bool>::value) {
+            m_properties.back().emplace_back(name, value ? "true" : "false");
+        } else {
+            m_properties.back().emplace_back(name, std::to_string(value));
+        }
+    }
+
+    void save_to_file(char const* filename) const {
+        std::ofstream out(filename);
         print_to(out);
         out.close();
     }
 
-    void print_line() const { print_line_to(m_properties.back(), std::cerr); }
+    void print_line() const { print_line_to(m_properties.back(), std::cerr); }
+
+    void print() const { print_to(std::cerr); }
+
+private:
+    std::vector<std::vector<property>> m_properties;
+
+    template <typename T>
+    void print_line_to(std::vector<property> const& properties, T& device) const {
+        device << "{";
+        for (uint64_t i = 0; i != properties.size(); ++i) {
+            auto const& p = properties[i];
+            device << "\"" << p.name << "\": \"" << p.value << "\"";
+            if (i != properties.size() - 1) {
+                device << ", ";
+            }
+        }
+        device << "}\n";
+    }
+
+    template <typename T>
+    void print_to(T& device) const {
+        for (auto const& properties : m_properties) {
+            print_line_to(properties, device);
+        }
+    }
+};
+
+/*
+    Streaming counterpart of json_lines for long-running benchmarks.
+    Properties are formatted directly into a reusable buffer (numbers with
+    std::to_chars, emitted as JSON numbers rather than strings) and completed
+    lines are written to the file descriptor whenever the buffer fills up,
+    so memory stays bounded by the buffer size and no allocation happens per
+    property. As with json_lines, new_line() separates lines; the last line is
+    completed by close() or by the destructor.
+*/
+struct json_lines_writer {
+    static constexpr size_t default_buffer_bytes = 64 * 1024;
+
+    json_lines_writer(char const* filename, size_t buffer_bytes = default_buffer_bytes)
+        : m_fd(::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644))
+        , m_owns_fd(true)
+        , m_buffer_bytes(buffer_bytes)
+        , m_line_end(0)
+        , m_open_line(false) {
+        if (m_fd == -1) throw std::runtime_error("cannot open file");
+        m_buffer.reserve(m_buffer_bytes);
+    }
+
+    /* Write to an already open file descriptor, e.g., STDOUT_FILENO, which is not closed. */
+    json_lines_writer(int fd, size_t buffer_bytes = default_buffer_bytes)
+        : m_fd(fd)
+        , m_owns_fd(false)
+        , m_buffer_bytes(buffer_bytes)
+        , m_line_end(0)
+        , m_open_line(false) {
+        m_buffer.reserve(m_buffer_bytes);
+    }
+
+    json_lines_writer(json_lines_writer const&) = delete;
+    json_lines_writer& operator=(json_lines_writer const&) = delete;
+
+    ~json_lines_writer() {
+        try {
+            close();
+        } catch (std::exception const& e) {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+
+    template <typename T>
+    void add(std::string_view name, T const& value) {
+        if (m_fd == -1) throw std::runtime_error("json_lines_writer is closed");
+        m_buffer.append(m_open_line ? ", " : "{");
+        m_open_line = true;
+        append_string(name);
+        m_buffer.append(": ");
+        if constexpr (std::is_same<T, bool>::value) {
+            m_buffer.append(value ? "true" : "false");
+        } else if constexpr (std::is_arithmetic<T>::value) {
+            if constexpr (std::is_floating_point<T>::value) {
+                if (!std::isfinite(value)) {  // not representable in JSON
+                    m_buffer.append("null");
+                    return;
+                }
+            }
+            char str[64];
+            auto res = std::to_chars(str, str + sizeof(str), value);
+            m_buffer.append(str, res.ptr);
+        } else {
+            static_assert(std::is_convertible<T const&, std::string_view>::value,
+                          "values must be arithmetic or strings");
+            append_string(value);
+        }
+    }
+
+    /* Complete the current line, if any. */
+    void new_line() {
+        if (!m_open_line) return;
+        m_buffer.append("}\n");
+        m_open_line = false;
+        m_line_end = m_buffer.size();
+        if (m_line_end >= m_buffer_bytes) flush();
+    }
+
+    /* Write all completed lines to the file descriptor. */
+    void flush() {
+        if (m_line_end == 0) return;
+        write_all(m_fd, m_buffer.data(), m_line_end);
+        m_buffer.erase(0, m_line_end);
+        m_line_end = 0;
+    }
+
+    void close() {
+        if (m_fd == -1) return;
+        new_line();
+        flush();
+        if (m_owns_fd && ::close(m_fd) != 0) {
+            m_fd = -1;
+            throw std::runtime_error("cannot close file");
+        }
+        m_fd = -1;
+    }
+
+private:
+    int m_fd;
+    bool m_owns_fd;
+    size_t m_buffer_bytes;
+    size_t m_line_end;  // end of the last completed line in m_buffer
+    bool m_open_line;
+    std::string m_buffer;
+
+    void append_string(std::string_view str) {
+        static constexpr char hex[] = "0123456789abcdef";
+        m_buffer.push_back('"');
+        for (char c : str) {
+            if (c == '"' || c == '\\') {
+                m_buffer.push_back('\\');
+                m_buffer.push_back(c);
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                m_buffer.append("\\u00");
+                m_buffer.push_back(hex[(c >> 4) & 0xf]);
+                m_buffer.push_back(hex[c & 0xf]);
+            } else {
+                m_buffer.push_back(c);
+            }
+        }
+        m_buffer.push_back('"');
+    }
+};
+
+/* Two-sided 95% quantile of Student's t distribution with the given degrees of freedom. */
+[[maybe_unused]] static double student_t_95(size_t degrees_of_freedom) {
+    static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+                                   2.262,  2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+                                   2.110,  2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+                                   2.060,  2.056, 2.052, 2.048, 2.045, 2.042};
+    if (degrees_of_freedom == 0) return 0.0;
+    if (degrees_of_freedom <= 30) return table[degrees_of_freedom - 1];
+    return 1.96;
+}
+
+/* The p-th percentile (0 <= p <= 100) of sorted values, interpolating between ranks. */
+[[maybe_unused]] static double percentile_of_sorted(std::vector<double> const& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    double rank = p / 100.0 * (sorted.size() - 1);
+    size_t lo = static_cast<size_t>(rank);
+    size_t hi = std::min(lo + 1, sorted.size() - 1);
+    return sorted[lo] + (rank - lo) * (sorted[hi] - sorted[lo]);
+}
+
+/* Summary statistics of a set of timings, in the unit of the timings. */
+struct statistics {
+    statistics() {}
+
+    statistics(std::vector<double> timings) {
+        runs = timings.size();
+        if (runs == 0) return;
+        std::sort(timings.begin(), timings.end());
+        mean = std::accumulate(timings.begin(), timings.end(), 0.0) / runs;
+        double sum_of_squares = 0.0;
+        for (auto t : timings) sum_of_squares += (t - mean) * (t - mean);
+        stddev = runs > 1 ? std::sqrt(sum_of_squares / (runs - 1)) : 0.0;
+        min = timings.front();
+        max = timings.back();
+        median = percentile_of_sorted(timings, 50);
+        p90 = percentile_of_sorted(timings, 90);
+        p99 = percentile_of_sorted(timings, 99);
+        p999 = percentile_of_sorted(timings, 99.9);
+        double half_width = student_t_95(runs - 1) * stddev / std::sqrt(runs);
+        ci95_low = mean - half_width;
+        ci95_high = mean + half_width;
+    }
+
+    /* Divide all timings by x, e.g., to get statistics per iteration. */
+    statistics& operator/=(double x) {
+        for (double* v : {&mean, &stddev, &min, &max, &median, &p90, &p99, &p999, &ci95_low,
+                          &ci95_high}) {
+            *v /= x;
+        }
+        return *this;
+    }
+
+    /* Half-width of the 95% confidence interval of the mean, relative to the mean. */
+    double relative_ci95() const { return mean > 0.0 ? (ci95_high - mean) / mean : 0.0; }
+
+    template <typename JsonLines>
+    void add_to(JsonLines& jl, std::string const& prefix = "") const {
+        jl.add(prefix + "runs", runs);
+        jl.add(prefix + "mean", mean);
+        jl.add(prefix + "stddev", stddev);
+        jl.add(prefix + "min", min);
+        jl.add(prefix + "median", median);
+        jl.add(prefix + "p90", p90);
+        jl.add(prefix + "p99", p99);
+        jl.add(prefix + "p99.9", p999);
+        jl.add(prefix + "max", max);
+        jl.add(prefix + "ci95_low", ci95_low);
+        jl.add(prefix + "ci95_high", ci95_high);
+    }
+
+    size_t runs = 0;
+    double mean = 0.0, stddev = 0.0;
+    double min = 0.0, max = 0.0;
+    double median = 0.0, p90 = 0.0, p99 = 0.0, p999 = 0.0;
+    double ci95_low = 0.0, ci95_high = 0.0;
+};
+
+/*
+    A log-linear histogram of non-negative values (HDR-histogram style) using
+    constant memory, about 30 KiB. Values are rounded to integers: values below 128
+    are recorded exactly, larger ones with a relative error of at most 1/128.
+    Count, sum, min and max are exact. Negative values are counted in the first
+    bucket, values of 2^64 or more in the last one. NaNs are not recorded, only
+    counted (see nan_count()). Histograms can be merged, e.g., to combine
+    per-thread instances.
+*/
+struct latency_histogram {
+    static constexpr uint64_t sub_bucket_bits = 7;
+    static constexpr uint64_t sub_buckets = uint64_t(1) << sub_bucket_bits;
+    static constexpr uint64_t half = sub_buckets / 2;
+    static constexpr size_t num_buckets = sub_buckets + (64 - sub_bucket_bits) * half;
+
+    latency_histogram() { reset(); }
+
+    void record(double value, uint64_t times = 1) {
+        if (std::isnan(value)) {
+            m_nan_count += times;
+            return;
+        }
+        static constexpr double two_to_64 = 18446744073709551616.0;
+        uint64_t v = 0;
+        if (value + 0.5 >= two_to_64) {
+            v = std::numeric_limits<uint64_t>::max();
+        } else if (value > 0.0) {
+            v = static_cast<uint64_t>(value + 0.5);
+        }
+        m_counts[bucket(v)] += times;
+        m_count += times;
+        m_sum += value * times;
+        m_sum_of_squares += value * value * times;
+        m_min = std::min(m_min, value);
+        m_max = std::max(m_max, value);
+    }
+
+    void merge(latency_histogram const& other) {
+        for (size_t i = 0; i != num_buckets; ++i) m_counts[i] += other.m_counts[i];
+        m_count += other.m_count;
+        m_nan_count += other.m_nan_count;
+        m_sum += other.m_sum;
+        m_sum_of_squares += other.m_sum_of_squares;
+        m_min = std::min(m_min, other.m_min);
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    void reset() {
+        m_counts.fill(0);
+        m_count = 0;
+        m_nan_count = 0;
+        m_sum = 0.0;
+        m_sum_of_squares = 0.0;
+        m_min = std::numeric_limits<double>::max();
+        m_max = 0.0;
+    }
+
+    uint64_t count() const { return m_count; }
+
+    /* Number of NaNs passed to record(), which are not part of count(). */
+    uint64_t nan_count() const { return m_nan_count; }
+
+    double sum() const { return m_sum; }
+    double mean() const { return m_count ? m_sum / m_count : 0.0; }
+    double min() const { return m_count ? m_min : 0.0; }
+    double max() const { return m_max; }
+
+    double stddev() const {
+        if (m_count < 2) return 0.0;
+        double variance = (m_sum_of_squares - m_count * mean() * mean()) / (m_count - 1);
+        return std::sqrt(std::max(0.0, variance));
+    }
+
+    /* The p-th percentile (0 <= p <= 100), as the midpoint of the bucket holding it,
+       clamped to [min(), max()]. Takes O(num_buckets) time. */
+    double percentile(double p) const {
+        if (m_count == 0) return 0.0;
+        if (p <= 0.0) return min();
+        if (p >= 100.0) return max();
+        uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100.0 * m_count));
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i != num_buckets; ++i) {
+            seen += m_counts[i];
+            if (seen >= rank) {
+                auto range = bucket_range(i);
+                double mid = range.first + (range.second - range.first) / 2.0;
+                return std::min(std::max(mid, min()), max());
+            }
+        }
+        return max();
+    }
+
+    double median() const { return percentile(50); }
+
+    statistics stats() const {
+        statistics st;
+        st.runs = m_count;
+        st.mean = mean();
+        st.stddev = stddev();
+        st.min = min();
+        st.max = max();
+        st.median = median();
+        st.p90 = percentile(90);
+        st.p99 = percentile(99);
+        st.p999 = percentile(99.9);
+        double half_width = 0.0;
+        if (m_count) half_width = student_t_95(m_count - 1) * st.stddev / std::sqrt(m_count);
+        st.ci95_low = st.mean - half_width;
+        st.ci95_high = st.mean + half_width;
+        return st;
+    }
+
+private:
+    std::array<uint64_t, num_buckets> m_counts;
+    uint64_t m_count;
+    uint64_t m_nan_count;
+    double m_sum;
+    double m_sum_of_squares;
+    double m_min;
+    double m_max;
+
+    static size_t bucket(uint64_t v) {
+        if (v < sub_buckets) return v;
+        uint64_t shift = (63 - __builtin_clzll(v)) - (sub_bucket_bits - 1);
+        return sub_buckets + (shift - 1) * half + ((v >> shift) - half);
+    }
+
+    /* The range [first, second) of integer values mapped to bucket i. */
+    static std::pair<double, double> bucket_range(size_t i) {
+        if (i < sub_buckets) return {double(i), double(i + 1)};
+        uint64_t shift = (i - sub_buckets) / half + 1;
+        uint64_t mantissa = (i - sub_buckets) % half + half;
+        return {std::ldexp(double(mantissa), shift), std::ldexp(double(mantissa + 1), shift)};
+    }
+};
+
+/* Calibrate clocks that need it, e.g., tsc_clock, when a timer using them is constructed. */
+template <typename ClockType, typename = void>
+struct clock_calibration {
+    static void run() {}
+};
+
+template <typename ClockType>
+struct clock_calibration<ClockType, std::void_t<decltype(ClockType::calibrate())>> {
+    static void run() { ClockType::calibrate(); }
+};
+
+template <typename ClockType, typename DurationType>
+struct timer {
+    timer() { clock_calibration<ClockType>::run(); }
+
+    void start() { m_start = ClockType::now(); }
+
+    void stop() {
+        m_stop = ClockType::now();
+        auto elapsed = std::chrono::duration_cast<DurationType>(m_stop - m_start);
+        m_timings.push_back(std::max(0.0, elapsed.count() - m_overhead));
+    }
+
+    /* Measure the time of an empty start()/stop() pair (the minimum over the given runs)
+       and subtract it from every subsequent timing. */
+    void calibrate_overhead(size_t runs = 1000) {
+        std::vector<double> timings;
+        timings.swap(m_timings);
+        m_overhead = 0.0;
+        for (size_t i = 0; i != runs; ++i) {
+            start();
+            stop();
+        }
+        m_overhead = runs ? min() : 0.0;
+        timings.swap(m_timings);
+    }
+
+    double overhead() const { return m_overhead; }
+
+    size_t runs() const { return m_timings.size(); }
+
+    void reset() { m_timings.clear(); }
+
+    double min() const {
+        if (m_timings.empty()) return 0.0;
+        return *std::min_element(m_timings.begin(), m_timings.end());
+    }
+
+    double max() const {
+        if (m_timings.empty()) return 0.0;
+        return *std::max_element(m_timings.begin(), m_timings.end());
+    }
+
+    double median() const { return percentile(50); }
+
+    /* The p-th percentile, with 0 <= p <= 100. */
+    double percentile(double p) const {
+        std::vector<double> sorted(m_timings);
+        std::sort(sorted.begin(), sorted.end());
+        return percentile_of_sorted(sorted, p);
+    }
+
+    double stddev() const { return statistics(m_timings).stddev; }
+
+    statistics stats() const { return statistics(m_timings); }
+
+    std::vector<double> const& timings() const { return m_timings; }
+
+    void discard_first() {
+        if (runs()) {
+            m_timings.erase(m_timings.begin());
+        }
+    }
+
+    void discard_min() {
+        if (runs() > 1) {
+            m_timings.erase(std::min_element(m_timings.begin(), m_timings.end()));
+        }
+    }
+
+    void discard_max() {
+        if (runs() > 1) {
+            m_timings.erase(std::max_element(m_timings.begin(), m_timings.end()));
+        }
+    }
+
+    double elapsed() { return std::accumulate(m_timings.begin(), m_timings.end(), 0.0); }
+
+    double average() { return elapsed() / runs(); }
+
+private:
+    typename ClockType::time_point m_start;
+    typename ClockType::time_point m_stop;
+    std::vector<double> m_timings;
+    double m_overhead = 0.0;
+};
+
+typedef std::chrono::high_resolution_clock clock_type;
+typedef std::chrono::microseconds duration_type;
+typedef timer<clock_type, duration_type> timer_type;
+
+/*
+    A clock reading the CPU timestamp counter, for timing regions of tens of nanoseconds.
+    On x86, rdtscp is fenced with lfence on both sides so that the timed instructions
+    can not move across it; on AArch64 the virtual counter is read after an isb.
+    Elsewhere, it falls back to std::chrono::steady_clock.
+    Ticks are converted to nanoseconds with a ratio calibrated against steady_clock
+    (which assumes an invariant TSC, as on all recent x86 CPUs). Calibration takes 20 ms
+    and runs once, at the first call to calibrate() or now(): timers using the clock
+    call calibrate() when constructed, so that it never falls within a timed region.
+    Times are counted from the calibration, so that they stay small enough to be
+    converted to double without losing precision.
+*/
+struct tsc_clock {
+    typedef std::chrono::duration<double, std::nano> duration;
+    typedef duration::rep rep;
+    typedef duration::period period;
+    typedef std::chrono::time_point<tsc_clock> time_point;
+    static constexpr bool is_steady = true;
+
+    static time_point now() {
+        calibration const& c = calibrated();
+        uint64_t elapsed_ticks = ticks() - c.epoch;
+        return time_point(duration(static_cast<double>(elapsed_ticks) * c.ratio));
+    }
+
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned aux;
+        _mm_lfence();
+        uint64_t t = __rdtscp(&aux);
+        _mm_lfence();
+        return t;
+#elif defined(__aarch64__)
+        uint64_t t;
+        asm volatile("isb; mrs %0, cntvct_el0" : "=r"(t)::"memory");
+        return t;
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+
+    /* Calibrate the clock, if not done yet. */
+    static void calibrate() { calibrated(); }
+
+    static double nanoseconds_per_tick() { return calibrated().ratio; }
+
+private:
+    struct calibration {
+        uint64_t epoch;
+        double ratio;
+    };
+
+    static calibration const& calibrated() {
+        static const calibration c = measure();
+        return c;
+    }
+
+    static calibration measure() {
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+        auto start = std::chrono::steady_clock::now();
+        uint64_t start_ticks = ticks();
+        auto stop = start;
+        while (stop - start < std::chrono::milliseconds(20)) {
+            stop = std::chrono::steady_clock::now();
+        }
+        uint64_t stop_ticks = ticks();
+        double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+        return {start_ticks, ns / (stop_ticks - start_ticks)};
+#else
+        return {ticks(), 1.0};
+#endif
+    }
+};
+
+typedef timer<tsc_clock, std::chrono::duration<double, std::nano>> tsc_timer_type;
+
+/*
+    A timer with the same interface as timer, but keeping its timings in a
+    latency_histogram instead of a vector: memory is constant however many
+    runs are timed, and instances can be merged. Percentiles are approximate.
+*/
+template <typename ClockType, typename DurationType>
+struct streaming_timer {
+    streaming_timer() { clock_calibration<ClockType>::run(); }
+
+    void start() { m_start = ClockType::now(); }
+
+    void stop() {
+        auto stop = ClockType::now();
+        auto elapsed = std::chrono::duration_cast<DurationType>(stop - m_start);
+        m_histogram.record(elapsed.count());
+    }
+
+    size_t runs() const { return m_histogram.count(); }
+
+    void reset() { m_histogram.reset(); }
+
+    void merge(streaming_timer const& other) { m_histogram.merge(other.m_histogram); }
+
+    double elapsed() const { return m_histogram.sum(); }
+    double average() const { return m_histogram.mean(); }
+    double min() const { return m_histogram.min(); }
+    double max() const { return m_histogram.max(); }
+    double median() const { return m_histogram.median(); }
+    double percentile(double p) const { return m_histogram.percentile(p); }
+    double stddev() const { return m_histogram.stddev(); }
+    statistics stats() const { return m_histogram.stats(); }
+
+    latency_histogram const& histogram() const { return m_histogram; }
+
+private:
+    typename ClockType::time_point m_start;
+    latency_histogram m_histogram;
+};
+
+typedef streaming_timer<clock_type, duration_type> streaming_timer_type;
+
+/*
+    Latency recorder for multi-threaded benchmarks.
+    Each thread times its operations with its own shard, obtained with
+    local(thread_id): shards are padded to cache lines and never shared, so
+    recording takes no locks. After the threads have joined, merged() combines
+    the shards into one latency distribution, and throughput() divides the total
+    number of operations by the wall-clock time between begin() and end().
+*/
+template <typename ClockType = clock_type, typename DurationType = duration_type>
+struct latency_recorder {
+    struct alignas(64) shard {
+        void start() { m_start = ClockType::now(); }
+
+        void stop() {
+            auto elapsed = std::chrono::duration_cast<DurationType>(ClockType::now() - m_start);
+            m_histogram.record(elapsed.count());
+        }
+
+        /* Record a latency measured by other means, in DurationType units. */
+        void record(double latency) { m_histogram.record(latency); }
+
+        latency_histogram const& histogram() const { return m_histogram; }
+
+    private:
+        typename ClockType::time_point m_start;
+        latency_histogram m_histogram;
+    };
+
+    latency_recorder(size_t num_threads)
+        : m_shards(num_threads) {
+        clock_calibration<ClockType>::run();
+        begin();
+    }
+
+    shard& local(size_t thread_id) {
+        assert(thread_id < m_shards.size());
+        return m_shards[thread_id];
+    }
+
+    size_t num_threads() const { return m_shards.size(); }
+
+    /* Mark the beginning and the end of the measured interval. */
+    void begin() { m_begin = m_end = ClockType::now(); }
+    void end() { m_end = ClockType::now(); }
+
+    latency_histogram merged() const {
+        latency_histogram h;
+        for (auto const& s : m_shards) h.merge(s.histogram());
+        return h;
+    }
+
+    /* Operations per second between begin() and end(). */
+    double throughput() const {
+        double seconds = std::chrono::duration<double>(m_end - m_begin).count();
+        return seconds > 0.0 ? merged().count() / seconds : 0.0;
+    }
+
+    template <typename JsonLines>
+    void add_to(JsonLines& jl, std::string const& prefix = "") const {
+        jl.add(prefix + "threads", num_threads());
+        jl.add(prefix + "throughput", throughput());
+        merged().stats().add_to(jl, prefix);
+    }
+
+private:
+    std::vector<shard> m_shards;
+    typename ClockType::time_point m_begin, m_end;
+};
+
+/*
+    Hardware performance counters of the calling thread, measured between start()
+    and stop() with Linux perf_event_open(). Counters that cannot be opened (e.g.,
+    on other systems, or in containers without access to perf events) are reported
+    as not available() and read as 0. Values are scaled when the kernel multiplexes
+    more counters than the hardware supports.
+*/
+struct perf_counters {
+    static constexpr size_t num_events = 6;
+    typedef std::array<double, num_events> values_type;
+
+    static char const* name(size_t i) {
+        static char const* names[num_events] = {"cycles",        "instructions", "L1d_misses",
+                                                "LLC_misses", "branch_misses", "dTLB_misses"};
+        return names[i];
+    }
+
+    perf_counters() {
+        m_fds.fill(-1);
+        m_values.fill(0.0);
+#ifdef __linux__
+        static const uint64_t read_miss =
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        static const std::pair<uint32_t, uint64_t> events[num_events] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | read_miss},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | read_miss},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | read_miss},
+        };
+        for (size_t i = 0; i != num_events; ++i) {
+            struct perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            m_fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+#endif
+    }
+
+    perf_counters(perf_counters const&) = delete;
+    perf_counters& operator=(perf_counters const&) = delete;
+
+    ~perf_counters() {
+        for (int fd : m_fds) {
+            if (fd != -1) ::close(fd);
+        }
+    }
+
+    bool available(size_t i) const { return m_fds[i] != -1; }
+
+    bool any_available() const {
+        for (size_t i = 0; i != num_events; ++i) {
+            if (available(i)) return true;
+        }
+        return false;
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int fd : m_fds) {
+            if (fd == -1) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (int fd : m_fds) {
+            if (fd != -1) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+        for (size_t i = 0; i != num_events; ++i) {
+            m_values[i] = 0.0;
+            uint64_t data[3];  // value, time enabled, time running
+            if (m_fds[i] == -1 || ::read(m_fds[i], data, sizeof(data)) != sizeof(data)) continue;
+            m_values[i] = data[2] ? static_cast<double>(data[0]) * data[1] / data[2] : 0.0;
+        }
+#endif
+    }
+
+    /* Counts measured by the last start()/stop() pair. */
+    values_type const& values() const { return m_values; }
+
+private:
+    std::array<int, num_events> m_fds;
+    values_type m_values;
+};
+
+/*
+    A timer that also records hardware performance counters for each
+    start()/stop() pair, with per-run and aggregated (total and average) values.
+*/
+template <typename ClockType, typename DurationType>
+struct perf_timer {
+    void start() {
+        m_counters.start();
+        m_timer.start();
+    }
+
+    void stop() {
+        m_timer.stop();
+        m_counters.stop();
+        m_runs.push_back(m_counters.values());
+    }
+
+    size_t runs() const { return m_runs.size(); }
+
+    void reset() {
+        m_timer.reset();
+        m_runs.clear();
+    }
+
+    bool available(size_t i) const { return m_counters.available(i); }
+
+    /* Counters of the r-th run. */
+    perf_counters::values_type const& run(size_t r) const { return m_runs[r]; }
+
+    double total(size_t i) const {
+        double sum = 0.0;
+        for (auto const& values : m_runs) sum += values[i];
+        return sum;
+    }
+
+    double average(size_t i) const { return runs() ? total(i) / runs() : 0.0; }
+
+    timer<ClockType, DurationType> const& wall_clock() const { return m_timer; }
+
+    /* Add the average time and counters per run to jl. Unavailable counters are
+       left out, so that every value is a number. */
+    template <typename JsonLines>
+    void add_to(JsonLines& jl, std::string const& prefix = "") const {
+        jl.add(prefix + "runs", runs());
+        jl.add(prefix + "time", runs() ? m_timer.stats().mean : 0.0);
+        for (size_t i = 0; i != perf_counters::num_events; ++i) {
+            if (available(i)) jl.add(prefix + perf_counters::name(i), average(i));
+        }
+    }
+
+private:
+    timer<ClockType, DurationType> m_timer;
+    perf_counters m_counters;
+    std::vector<perf_counters::values_type> m_runs;
+};
+
+typedef perf_timer<clock_type, duration_type> perf_timer_type;
+
+/*
+    Options of a benchmark.
+
+    min_sample_seconds: each run calls the benchmarked function enough times
+    to last at least this long, so that short functions can be measured.
+    warmup_tolerance, max_warmup_runs: runs are considered warm-up, and discarded,
+    while they are faster than all previous runs by more than warmup_tolerance.
+    max_relative_ci: stop when the half-width of the 95% confidence interval
+    of the mean is at most this fraction of the mean...
+    min_runs, max_runs, max_seconds: ...but do at least min_runs runs, and stop anyway
+    after max_runs runs or max_seconds seconds.
+*/
+struct benchmark_options {
+    double min_sample_seconds = 0.001;
+    double warmup_tolerance = 0.05;
+    size_t max_warmup_runs = 100;
+    double max_relative_ci = 0.01;
+    size_t min_runs = 10;
+    size_t max_runs = 1000;
+    double max_seconds = 10.0;
+};
+
+/*
+    Run a function until its timing is statistically stable.
+    Statistics are per call of the function, in DurationType units.
+*/
+template <typename ClockType = clock_type, typename DurationType = duration_type>
+struct benchmark {
+    benchmark(benchmark_options const& opts = benchmark_options())
+        : m_opts(opts)
+        , m_iterations(1)
+        , m_warmup_runs(0) {}
+
+    template <typename F>
+    statistics const& run(F&& f) {
+        m_warmup_runs = 0;
+        auto sample = [&]() {
+            m_timer.reset();
+            m_timer.start();
+            for (size_t i = 0; i != m_iterations; ++i) f();
+            m_timer.stop();
+            return m_timer.timings().back();
+        };
+
+        /* max_seconds bounds all the runs, warm-up included: a run is started only if
+           one as long as the last fits in what is left */
+        double elapsed = 0.0, last = 0.0;
+        double max_elapsed = m_opts.max_seconds * seconds_to_units;
+        auto timed_sample = [&]() {
+            last = sample();
+            elapsed += last;
+            return last;
+        };
+        auto within_budget = [&]() { return elapsed + last <= max_elapsed; };
+
+        /* choose the number of iterations per run (these runs count as warm-up) */
+        double min_sample = m_opts.min_sample_seconds * seconds_to_units;
+        for (m_iterations = 1;; ++m_warmup_runs) {
+            double t = timed_sample();
+            if (t >= min_sample || m_iterations >= (size_t(1) << 40)) break;
+            if (elapsed >= max_elapsed) break;
+            double scale = t > 0.0 ? 1.2 * min_sample / t : 10.0;
+            scale = std::min(std::max(scale, 1.5), 10.0);
+            size_t next = std::max(m_iterations + 1, static_cast<size_t>(m_iterations * scale));
+            /* do not grow runs past the remaining budget */
+            double per_call = t / m_iterations;
+            if (per_call > 0.0 && next * per_call > max_elapsed - elapsed) {
+                next = static_cast<size_t>((max_elapsed - elapsed) / per_call);
+                if (next <= m_iterations) break;
+            }
+            m_iterations = next;
+        }
+
+        /* warm up until runs stop getting faster */
+        if (within_budget()) {
+            for (double best = timed_sample();
+                 m_warmup_runs < m_opts.max_warmup_runs && within_budget(); ++m_warmup_runs) {
+                double t = timed_sample();
+                if (t >= (1.0 - m_opts.warmup_tolerance) * best) break;
+                best = t;
+            }
+        }
+
+        /* at least one run is measured, even if warm-up used up the budget */
+        std::vector<double> timings;
+        double sum = 0.0, sum_of_squares = 0.0;
+        while (timings.empty() || (timings.size() < m_opts.max_runs && within_budget())) {
+            double t = timed_sample();
+            timings.push_back(t);
+            sum += t;
+            sum_of_squares += t * t;
+            size_t n = timings.size();
+            if (n >= std::max<size_t>(m_opts.min_runs, 2)) {
+                double mean = sum / n;
+                double variance = std::max(0.0, (sum_of_squares - n * mean * mean) / (n - 1));
+                double half_width = student_t_95(n - 1) * std::sqrt(variance / n);
+                if (half_width <= m_opts.max_relative_ci * mean) break;
+            }
+        }
+
+        m_stats = statistics(timings);
+        m_stats /= m_iterations;
+        return m_stats;
+    }
+
+    statistics const& stats() const { return m_stats; }
+
+    /* Number of calls of the function per timed run. */
+    size_t iterations() const { return m_iterations; }
+
+    /* Number of runs discarded as warm-up (including those choosing iterations()). */
+    size_t warmup_runs() const { return m_warmup_runs; }
+
+    template <typename JsonLines>
+    void add_to(JsonLines& jl, std::string const& prefix = "") const {
+        jl.add(prefix + "iterations", m_iterations);
+        jl.add(prefix + "warmup_runs", m_warmup_runs);
+        m_stats.add_to(jl, prefix);
+    }
+
+private:
+    static constexpr double seconds_to_units =
+        static_cast<double>(DurationType::period::den) / DurationType::period::num;
+
+    benchmark_options m_opts;
+    size_t m_iterations;
+    size_t m_warmup_runs;
+    timer<ClockType, DurationType> m_timer;
+    statistics m_stats;
+};
+
+[[maybe_unused]] static unsigned get_random_seed() {
+    return std::chrono::system_clock::now().time_since_epoch().count();
+}
+
+template <typename IntType>
+struct uniform_int_rng {
+    uniform_int_rng(IntType from, IntType to, unsigned seed = 13)
+        : m_rng(seed)
+        , m_distr(from, to) {}
+
+    IntType gen() { return m_distr(m_rng); }
+
+private:
+    std::mt19937_64 m_rng;
+    std::uniform_int_distribution<IntType> m_distr;
+};
+
+struct generic_loader {
+    generic_loader(std::istream& is, format_options const& opts = {})
+        : m_num_bytes_pods(0)
+        , m_num_bytes_vecs_of_pods(0)
+        , m_offset(0)
+        , m_checksum(0)
+        , m_opts(opts)
+        , m_header()
+        , m_is(is) {
+        m_opts.validate();
+    }
+
+    /* Throw if the file was saved from a type with a different layout. */
+    void check_layout(uint64_t layout_hash) {
+        read_header();
+        if (m_opts.header) m_header.check_layout(layout_hash);
+    }
+
+    /* Throw if the payload read so far does not match the header.
+       Only meaningful after having visited the whole data structure. */
+    void check_checksum() const {
+        if (!m_opts.header) return;
+        if (m_offset != sizeof(m_header) + m_header.payload_bytes) {
+            throw std::runtime_error("file_header: payload size mismatch");
+        }
+        if (m_opts.verify_checksum) m_header.check_checksum(m_checksum);
+    }
+
+    template <typename T>
+    void visit(T& val) {
+        if constexpr (is_pod<T>::value) {
+            read(reinterpret_cast<char*>(&val), sizeof(T));
+            m_num_bytes_pods += pod_bytes(val);
+        } else {
+            val.visit(*this);
+        }
+    }
+
+    template <typename T, typename Allocator>
+    void visit(std::vector<T, Allocator>& vec) {
+        size_t n;
+        visit(n);
+        vec.resize(n);
+        if constexpr (is_pod<T>::value) {
+            read_payload(vec.data(), n);
+        } else {
+            for (auto& v : vec) visit(v);
+        }
+    }
+
+    template <typename T>
+    void visit(owning_span<T>& vec) {
+        size_t n;
+        visit(n);
+        std::vector<T> tmp(n);
+        if constexpr (is_pod<T>::value) {
+            read_payload(tmp.data(), n);
+        } else {
+            for (auto& v : tmp) visit(v);
+        }
+        vec = std::move(tmp);
+    }
+
+    template <typename T>
+    void visit(compressed_span<T>& span) {
+        size_t n;
+        visit(n);
+        skip_padding<uint64_t>();
+        uint64_t encoded_bytes = 0;
+        read(reinterpret_cast<char*>(&encoded_bytes), sizeof(encoded_bytes));
+        check_remaining(encoded_bytes);
+        auto encoded = std::make_shared<std::vector<uint8_t>>(encoded_bytes);
+        read(reinterpret_cast<char*>(encoded->data()), encoded_bytes);
+        if (!m_is.good()) throw std::runtime_error("unexpected end of file");
+        span = compressed_span<T>(encoded->data(), encoded_bytes, n, encoded);
+    }
+
+    size_t bytes() { return m_is.tellg(); }
+    size_t bytes_pods() { return m_num_bytes_pods; }
+    size_t bytes_vecs_of_pods() { return m_num_bytes_vecs_of_pods; }
+
+protected:
+    /* If non-zero, payloads of at least this many bytes are not read but only
+       recorded in m_deferred, to be read later (see parallel_loader). */
+    size_t m_min_deferred_bytes = 0;
+    std::vector<io_request<char*>> m_deferred;
+
+    /* Number of threads decoding compressed sequences. */
+    size_t m_decoding_threads = 1;
+
+private:
+    size_t m_num_bytes_pods;
+    size_t m_num_bytes_vecs_of_pods;
+    size_t m_offset;
+    uint32_t m_checksum;
+    format_options m_opts;
+    file_header m_header;
+    std::istream& m_is;
+
+    /* The header is read lazily since m_is may not be constructed yet
+       when this constructor runs (see loader). */
+    void read_header() {
+        if (!m_opts.header || m_offset != 0) return;
+        load_pod(m_is, m_header);
+        if (!m_is.good()) throw std::runtime_error("file_header: file too short");
+        m_header.validate();
+        m_opts.alignment = m_header.alignment;
+        m_opts.compress = m_header.compressed();
+        m_opts.validate();
+        m_offset += sizeof(m_header);
+    }
+
+    /* Throw if fewer than num_bytes are left in the stream. Checked before allocating
+       a size read from the stream. Streams that cannot seek are not checked. */
+    void check_remaining(uint64_t num_bytes) {
+        auto pos = m_is.tellg();
+        if (pos == std::streampos(-1)) return;
+        m_is.seekg(0, std::ios::end);
+        auto end = m_is.tellg();
+        m_is.seekg(pos);
+        if (end != std::streampos(-1) && num_bytes > static_cast<uint64_t>(end - pos)) {
+            throw std::runtime_error("unexpected end of file");
+        }
+    }
+
+    void read(char* data, size_t num_bytes) {
+        read_header();
+        m_is.read(data, static_cast<std::streamsize>(num_bytes));
+        if (m_opts.verify_checksum) m_checksum = crc32c(data, num_bytes, m_checksum);
+        m_offset += num_bytes;
+    }
+
+    template <typename T>
+    void skip_padding() {
+        char padding[64];
+        for (size_t pad = m_opts.padding<T>(m_offset); pad != 0;) {
+            size_t chunk = std::min<size_t>(pad, sizeof(padding));
+            read(padding, chunk);
+            pad -= chunk;
+        }
+    }
+
+    template <typename T>
+    void read_payload(T* data, size_t n) {
+        if constexpr (block_codec::compressible<T>) {
+            if (m_opts.compress) {
+                read_compressed(data, n);
+                return;
+            }
+        }
+        skip_padding<T>();
+        size_t num_bytes = n * sizeof(T);
+        if (m_min_deferred_bytes != 0 && num_bytes >= m_min_deferred_bytes &&
+            !m_opts.verify_checksum) {
+            m_deferred.push_back({reinterpret_cast<char*>(data), m_offset, num_bytes});
+            m_is.seekg(static_cast<std::streamoff>(num_bytes), std::ios::cur);
+            m_offset += num_bytes;
+        } else {
+            read(reinterpret_cast<char*>(data), num_bytes);
+        }
+        m_num_bytes_vecs_of_pods += num_bytes;
+    }
+
+    template <typename T>
+    void read_compressed(T* data, size_t n) {
+        skip_padding<uint64_t>();
+        uint64_t encoded_bytes = 0;
+        read(reinterpret_cast<char*>(&encoded_bytes), sizeof(encoded_bytes));
+        check_remaining(encoded_bytes);
+        std::vector<uint8_t> encoded(encoded_bytes);
+        read(reinterpret_cast<char*>(encoded.data()), encoded_bytes);
+        if (!m_is.good()) throw std::runtime_error("unexpected end of file");
+        block_codec::decode(encoded.data(), encoded_bytes, data, n, m_decoding_threads);
+        m_num_bytes_vecs_of_pods += n * sizeof(T);
+    }
+};
+
+struct loader : generic_loader {
+    loader(char const* filename, format_options const& opts = {})
+        : generic_loader(m_is, opts)
+        , m_is(filename, std::ios::binary) {
+        if (!m_is.good()) {
+            throw std::runtime_error(
+                "Error in opening binary "
+                "file.");
+        }
+    }
+
+private:
+    std::ifstream m_is;
+};
+
+/*
+    Loader that fills large arrays concurrently.
+    The data structure is visited sequentially as with loader, except that payloads
+    of at least min_parallel_bytes are only allocated and their file offsets recorded.
+    Then, read_deferred() fills them with pread() from num_threads threads,
+    so that loading scales with storage bandwidth rather than with one core.
+    Verifying the checksum requires reading sequentially, so it disables deferral.
+    Compressed sequences are read sequentially and decoded by num_threads threads.
+    With direct_io, deferred payloads are read with O_DIRECT (see pread_file).
+*/
+struct parallel_loader : loader {
+    parallel_loader(char const* filename, size_t num_threads, format_options const& opts = {},
+                    size_t min_parallel_bytes = 4 * MiB, bool direct_io = false)
+        : loader(filename, opts)
+        , m_num_threads(num_threads)
+        , m_file(filename, direct_io) {
+        m_min_deferred_bytes = std::max<size_t>(min_parallel_bytes, 1);
+        m_decoding_threads = num_threads;
+    }
+
+    /* Read all deferred payloads. Must be called before using the visited data. */
+    void read_deferred() {
+        m_file.read(m_deferred, m_num_threads);
+        m_deferred.clear();
+    }
+
+    /* Whether deferred payloads are read with O_DIRECT. */
+    bool direct_io() const { return m_file.direct(); }
+
+private:
+    size_t m_num_threads;
+    pread_file m_file;
+};
+
+/*
+    Loader that decodes directly from a memory-mapped file.
+    A cursor walks the mapped bytes: PODs and sizes are copied out of the map,
+    owning_spans of PODs point into the map (sharing ownership of it),
+    and everything else, including compressed sequences, is materialized on the heap.
+*/
+struct mmap_loader {
+    mmap_loader(uint8_t const* mmap_base, size_t mmap_size,
+                std::shared_ptr<const void> owner = {},
+                format_options const& opts = {})  //
+        : m_num_bytes_pods(0)
+        , m_num_bytes_vecs_of_pods(0)
+        , m_opts(opts)
+        , m_header()
+        , m_base(mmap_base)
+        , m_cur(mmap_base)
+        , m_end(mmap_base + mmap_size)
+        , m_owner(std::move(owner)) {
+        m_opts.validate();
+        if (m_opts.header) {
+            if (mmap_size < sizeof(m_header)) {
+                throw std::runtime_error("file_header: file too short");
+            }
+            std::memcpy(&m_header, advance(sizeof(m_header)), sizeof(m_header));
+            m_header.validate();
+            if (m_header.payload_bytes != mmap_size - sizeof(m_header)) {
+                throw std::runtime_error("file_header: payload size mismatch");
+            }
+            m_opts.alignment = m_header.alignment;
+            m_opts.compress = m_header.compressed();
+            m_opts.validate();
+        }
+    }
+
+    /* Throw if the file was saved from a type with a different layout. */
+    void check_layout(uint64_t layout_hash) const {
+        if (m_opts.header) m_header.check_layout(layout_hash);
+    }
+
+    /* Checksum the whole payload in one pass over the mapped bytes. */
+    void check_checksum() const {
+        if (!m_opts.header || !m_opts.verify_checksum) return;
+        m_header.check_checksum(crc32c(m_base + sizeof(m_header), m_header.payload_bytes));
+    }
+
+    template <typename T>
+    void visit(T& val) {
+        if constexpr (is_pod<T>::value) {
+            std::memcpy(&val, advance(sizeof(T)), sizeof(T));
+            m_num_bytes_pods += pod_bytes(val);
+        } else {
+            val.visit(*this);
+        }
+    }
+
+    template <typename T, typename Allocator>
+    void visit(std::vector<T, Allocator>& vec) {
+        size_t n;
+        visit(n);
+        if constexpr (is_pod<T>::value) {
+            check_size<T>(n);
+            vec.resize(n);
+            if constexpr (block_codec::compressible<T>) {
+                if (m_opts.compress) {
+                    decode(vec.data(), n);
+                    return;
+                }
+            }
+            T const* data = payload<T>(n);
+            if (n != 0) std::memcpy(vec.data(), data, n * sizeof(T));
+        } else {
+            vec.resize(n);
+            for (auto& v : vec) visit(v);
+        }
+    }
+
+    template <typename T>
+    void visit(owning_span<T>& vec) {
+        size_t n;
+        visit(n);
+        if constexpr (is_pod<T>::value) {
+            check_size<T>(n);
+            if constexpr (block_codec::compressible<T>) {
+                if (m_opts.compress) {
+                    std::vector<T> tmp(n);
+                    decode(tmp.data(), n);
+                    vec = std::move(tmp);
+                    return;
+                }
+            }
+            vec = owning_span<T>(payload<T>(n), n, m_owner);
+        } else {
+            std::vector<T> tmp(n);
+            for (auto& v : tmp) visit(v);
+            vec = std::move(tmp);
+        }
+    }
+
+    /* O(1): blocks are decoded from the map on access. */
+    template <typename T>
+    void visit(compressed_span<T>& span) {
+        size_t n;
+        visit(n);
+        advance(m_opts.padding<uint64_t>(bytes()));
+        uint64_t encoded_bytes;
+        std::memcpy(&encoded_bytes, advance(sizeof(encoded_bytes)), sizeof(encoded_bytes));
+        if (encoded_bytes > static_cast<size_t>(m_end - m_cur) ||
+            !block_codec::fits(n, encoded_bytes)) {
+            throw std::runtime_error("mmap_loader: corrupted compressed_span");
+        }
+        span = compressed_span<T>(advance(encoded_bytes), encoded_bytes, n, m_owner);
+    }
+
+    size_t bytes() const { return m_cur - m_base; }
+    size_t bytes_pods() const { return m_num_bytes_pods; }
+    size_t bytes_vecs_of_pods() const { return m_num_bytes_vecs_of_pods; }
+
+private:
+    size_t m_num_bytes_pods;
+    size_t m_num_bytes_vecs_of_pods;
+    format_options m_opts;
+    file_header m_header;
+    uint8_t const* m_base;
+    uint8_t const* m_cur;
+    uint8_t const* m_end;
+    std::shared_ptr<const void> m_owner;
+
+    /* Return the current position and move the cursor num_bytes forward. */
+    uint8_t const* advance(size_t num_bytes) {
+        if (num_bytes > static_cast<size_t>(m_end - m_cur)) {
+            throw std::runtime_error("mmap_loader: read past the end of the mapped file");
+        }
+        uint8_t const* ptr = m_cur;
+        m_cur += num_bytes;
+        return ptr;
+    }
+
+    /* Throw if a sequence of n elements of type T cannot fit in the rest of the file.
+       Checked before allocating or computing n * sizeof(T), which may overflow for a
+       corrupt n. */
+    template <typename T>
+    void check_size(size_t n) const {
+        size_t remaining = m_end - m_cur;
+        bool fits = n <= remaining / sizeof(T);
+        if constexpr (block_codec::compressible<T>) {
+            /* each block has at least its entry in the table of offsets */
+            if (m_opts.compress) {
+                fits = n / block_codec::block_size <= remaining / sizeof(uint64_t);
+            }
+        }
+        if (!fits) throw std::runtime_error("mmap_loader: read past the end of the mapped file");
+    }
+
+    /* Skip the padding and return the payload of a sequence of n elements of type T. */
+    template <typename T>
+    T const* payload(size_t n) {
+        advance(m_opts.padding<T>(bytes()));
+        check_size<T>(n);
+        m_num_bytes_vecs_of_pods += n * sizeof(T);
+        return reinterpret_cast<T const*>(advance(n * sizeof(T)));
+    }
+
+    template <typename T>
+    void decode(T* data, size_t n) {
+        advance(m_opts.padding<uint64_t>(bytes()));
+        uint64_t encoded_bytes;
+        std::memcpy(&encoded_bytes, advance(sizeof(encoded_bytes)), sizeof(encoded_bytes));
+        uint8_t const* encoded = advance(encoded_bytes);
+        block_codec::decode(encoded, encoded_bytes, data, n);
+        m_num_bytes_vecs_of_pods += n * sizeof(T);
+    }
+};
+
+/*
+    Loader visiting a file in constant memory, e.g., to scan, verify or transform
+    files larger than RAM. PODs are read into the visited data structure as with
+    loader, but arrays of PODs are not materialized: their values are read into a
+    buffer of chunk_bytes, reused for all arrays, and passed to f(data, n, first),
+    where data points to the values first, ..., first + n - 1 of the array.
+    Compressed arrays are decoded block by block. Non-POD elements of sequences are
+    visited one at a time, each through a fresh temporary object.
+    Since f is called with arrays of different types, it is usually a generic lambda:
+        [&](auto const* data, size_t n, size_t first) { ... }
+*/
+template <typename F>
+struct streaming_loader {
+    streaming_loader(char const* filename, F f, format_options const& opts = {},
+                     size_t chunk_bytes = 4 * MiB)
+        : m_f(std::move(f))
+        , m_offset(0)
+        , m_checksum(0)
+        , m_opts(opts)
+        , m_header()
+        , m_chunk_bytes(std::max(chunk_bytes, block_codec::block_size * sizeof(uint64_t)))
+        , m_buffer(nullptr, &std::free)
+        , m_is(filename, std::ios::binary) {
+        if (!m_is.good()) {
+            throw std::runtime_error(
+                "Error in opening binary "
+                "file.");
+        }
+        m_opts.validate();
+        static const size_t alignment = 64;
+        m_buffer.reset(static_cast<uint8_t*>(
+            std::aligned_alloc(alignment, (m_chunk_bytes + alignment - 1) / alignment * alignment)));
+        if (m_buffer == nullptr) throw std::runtime_error("malloc failed");
+        if (m_opts.header) {
+            read(&m_header, sizeof(m_header));
+            m_header.validate();
+            m_opts.alignment = m_header.alignment;
+            m_opts.compress = m_header.compressed();
+            m_opts.validate();
+            m_checksum = 0;
+        }
+    }
+
+    void check_layout(uint64_t layout_hash) const {
+        if (m_opts.header) m_header.check_layout(layout_hash);
+    }
+
+    /* Only meaningful after having visited the whole data structure. */
+    void check_checksum() const {
+        if (!m_opts.header) return;
+        if (m_offset != sizeof(m_header) + m_header.payload_bytes) {
+            throw std::runtime_error("file_header: payload size mismatch");
+        }
+        if (m_opts.verify_checksum) m_header.check_checksum(m_checksum);
+    }
+
+    template <typename T>
+    void visit(T& val) {
+        if constexpr (is_pod<T>::value) {
+            read(&val, sizeof(T));
+        } else {
+            val.visit(*this);
+        }
+    }
+
+    template <typename T, typename Allocator>
+    void visit(std::vector<T, Allocator>&) {
+        visit_seq<T>();
+    }
+
+    template <typename T>
+    void visit(owning_span<T>&) {
+        visit_seq<T>();
+    }
+
+    template <typename T>
+    void visit(compressed_span<T>&) {
+        size_t n;
+        visit(n);
+        visit_compressed<T>(n);
+    }
+
+    size_t bytes() const { return m_offset; }
+
+private:
+    F m_f;
+    size_t m_offset;
+    uint32_t m_checksum;
+    format_options m_opts;
+    file_header m_header;
+    size_t m_chunk_bytes;
+    std::unique_ptr<uint8_t, decltype(&std::free)> m_buffer;
+    std::ifstream m_is;
+
+    void read(void* data, size_t num_bytes) {
+        m_is.read(static_cast<char*>(data), static_cast<std::streamsize>(num_bytes));
+        if (!m_is.good()) throw std::runtime_error("unexpected end of file");
+        if (m_opts.verify_checksum) m_checksum = crc32c(data, num_bytes, m_checksum);
+        m_offset += num_bytes;
+    }
+
+    void skip(size_t num_bytes) {
+        if (!m_opts.verify_checksum) {
+            m_is.seekg(static_cast<std::streamoff>(num_bytes), std::ios::cur);
+            m_offset += num_bytes;
+            return;
+        }
+        for (size_t chunk = 0; num_bytes != 0; num_bytes -= chunk) {
+            chunk = std::min(num_bytes, m_chunk_bytes);
+            read(m_buffer.get(), chunk);
+        }
+    }
+
+    template <typename T>
+    void visit_seq() {
+        size_t n;
+        visit(n);
+        if constexpr (is_pod<T>::value) {
+            if constexpr (block_codec::compressible<T>) {
+                if (m_opts.compress) {
+                    visit_compressed<T>(n);
+                    return;
+                }
+            }
+            skip(m_opts.padding<T>(m_offset));
+            if (sizeof(T) > m_chunk_bytes) {
+                throw std::runtime_error("streaming_loader: chunk_bytes smaller than an element");
+            }
+            T* buffer = reinterpret_cast<T*>(m_buffer.get());
+            size_t chunk = m_chunk_bytes / sizeof(T);
+            for (size_t first = 0; first < n; first += chunk) {
+                size_t k = std::min(chunk, n - first);
+                read(buffer, k * sizeof(T));
+                m_f(static_cast<T const*>(buffer), k, first);
+            }
+        } else {
+            for (size_t i = 0; i != n; ++i) {
+                T tmp{};
+                visit(tmp);
+            }
+        }
+    }
+
+    template <typename T>
+    void visit_compressed(size_t n) {
+        skip(m_opts.padding<uint64_t>(m_offset));
+        uint64_t encoded_bytes;
+        read(&encoded_bytes, sizeof(encoded_bytes));
+        if (!block_codec::fits(n, encoded_bytes)) {
+            throw std::runtime_error("block_codec: corrupted encoding");
+        }
+        size_t num_blocks = block_codec::num_blocks(n);
+        skip(num_blocks * 8);  // blocks are stored in order: the offsets are not needed
+        uint64_t remaining = encoded_bytes - num_blocks * 8;
+
+        static constexpr size_t block_size = block_codec::block_size;
+        T* buffer = reinterpret_cast<T*>(m_buffer.get());
+        size_t chunk = m_chunk_bytes / sizeof(T) / block_size * block_size;
+        uint8_t block[block_codec::max_block_bytes];
+        for (size_t b = 0, filled = 0, first = 0; b != num_blocks; ++b) {
+            size_t len = std::min(block_size, n - b * block_size);
+            if (remaining < block_codec::block_header_bytes) {
+                throw std::runtime_error("block_codec: corrupted encoding");
+            }
+            read(block, block_codec::block_header_bytes);
+            size_t num_bytes = block_codec::block_bytes(block, len);
+            if (num_bytes > remaining) throw std::runtime_error("block_codec: corrupted encoding");
+            read(block + block_codec::block_header_bytes,
+                 num_bytes - block_codec::block_header_bytes);
+            remaining -= num_bytes;
+            block_codec::decode_block_at(block, num_bytes, len, buffer + filled);
+            filled += len;
+            if (filled == chunk || b == num_blocks - 1) {
+                m_f(static_cast<T const*>(buffer), filled, first);
+                first += filled;
+                filled = 0;
+            }
+        }
+        if (remaining != 0) throw std::runtime_error("block_codec: corrupted encoding");
+    }
+};
+
+struct generic_saver {
+    generic_saver(std::ostream& os, format_options const& opts = {})
+        : m_offset(0)
+        , m_checksum(0)
+        , m_arena_bytes(0)
+        , m_opts(opts)
+        , m_os(os) {
+        m_opts.validate();
+    }
+
+    /* Write the header at the beginning of the stream, which must be seekable.
+       To be called after having visited the whole data structure. */
+    void write_header(uint64_t layout_hash) {
+        if (!m_opts.header) return;
+        reserve_header();
+        if (m_header_pos == std::streampos(-1)) {
+            throw std::runtime_error("file_header: the output stream is not seekable");
+        }
+        auto header = file_header::make(
+            m_opts.alignment, layout_hash, m_offset - sizeof(file_header), m_checksum,
+            m_arena_bytes, m_opts.compress ? file_header::flag_compressed : 0);
+        auto end = m_os.tellp();
+        m_os.seekp(m_header_pos);
+        save_pod(m_os, header);
+        m_os.seekp(end);
+    }
+
+    template <typename T>
+    void visit(T const& val) {
+        if constexpr (is_pod<T>::value) {
+            write(reinterpret_cast<char const*>(&val), sizeof(T));
+        } else {
+            val.visit(*this);
+        }
+    }
+
+    template <typename T, typename Allocator>
+    void visit(std::vector<T, Allocator> const& vec) {
+        visit_seq(vec);
+    }
+
+    template <typename T>
+    void visit(owning_span<T> const& vec) {
+        visit_seq(vec);
+    }
+
+    template <typename T>
+    void visit(compressed_span<T> const& span) {
+        size_t n = span.size();
+        visit(n);
+        write_padding<uint64_t>();
+        uint64_t encoded_bytes = span.encoded_bytes();
+        write(reinterpret_cast<char const*>(&encoded_bytes), sizeof(encoded_bytes));
+        write(reinterpret_cast<char const*>(span.encoded()), encoded_bytes);
+        m_arena_bytes += arena_padding<uint64_t>(m_arena_bytes) + encoded_bytes;
+    }
+
+    size_t bytes() { return m_os.tellp(); }
 
-    void print() const { print_to(std::cerr); }
+    void flush() { m_os.flush(); }
+
+protected:
+    /* If non-zero, payloads of at least this many bytes are not written but only
+       recorded in m_deferred, to be written later (see parallel_saver). */
+    size_t m_min_deferred_bytes = 0;
+    std::vector<io_request<char const*>> m_deferred;
 
 private:
-    std::vector<std::vector<property>> m_properties;
+    size_t m_offset;
+    uint32_t m_checksum;
+    size_t m_arena_bytes;
+    format_options m_opts;
+    std::streampos m_header_pos;
+    std::ostream& m_os;
 
-    template <typename T>
-    void print_line_to(std::vector<property> const& properties, T& device) const {
-        device << "{";
-        for (uint64_t i = 0; i != properties.size(); ++i) {
-            auto const& p = properties[i];
-            device << "\"" << p.name << "\": \"" << p.value << "\"";
-            if (i != properties.size() - 1) {
-                device << ", ";
+    /* Reserve space for the header, written by write_header(). This is done lazily
+       since m_os may not be constructed yet when this constructor runs (see saver). */
+    void reserve_header() {
+        if (!m_opts.header || m_offset != 0) return;
+        m_header_pos = m_os.tellp();
+        save_pod(m_os, file_header::make(0, 0, 0, 0, 0));
+        m_offset += sizeof(file_header);
+    }
+
+    void write(char const* data, size_t num_bytes) {
+        reserve_header();
+        m_os.write(data, static_cast<std::streamsize>(num_bytes));
+        if (m_opts.header) m_checksum = crc32c(data, num_bytes, m_checksum);
+        m_offset += num_bytes;
+    }
+
+    template <typename Vec>
+    void visit_seq(Vec const& vec) {
+        using T = typename Vec::value_type;
+        size_t n = vec.size();
+        visit(n);
+        if constexpr (is_pod<T>::value) {
+            if constexpr (block_codec::compressible<T>) {
+                if (m_opts.compress) {
+                    write_compressed(vec.data(), n);
+                    return;
+                }
             }
+            write_padding<T>();
+            auto data = reinterpret_cast<char const*>(vec.data());
+            size_t num_bytes = sizeof(T) * n;
+            m_arena_bytes += arena_padding<T>(m_arena_bytes) + num_bytes;
+            if (m_min_deferred_bytes != 0 && num_bytes >= m_min_deferred_bytes) {
+                /* leave a hole in the file, filled in by the deferred write */
+                m_deferred.push_back({data, m_offset, num_bytes});
+                m_os.seekp(static_cast<std::streamoff>(num_bytes), std::ios::cur);
+                if (m_opts.header) m_checksum = crc32c(data, num_bytes, m_checksum);
+                m_offset += num_bytes;
+            } else {
+                write(data, num_bytes);
+            }
+        } else {
+            for (auto const& v : vec) visit(v);
         }
-        device << "}\n";
     }
 
     template <typename T>
-    void print_to(T& device) const {
-        for (auto const& properties : m_properties) {
-            print_line_to(properties, device);
+    void write_padding() {
+        static const char zeros[64] = {};
+        for (size_t pad = m_opts.padding<T>(m_offset); pad != 0;) {
+            size_t chunk = std::min<size_t>(pad, sizeof(zeros));
+            write(zeros, chunk);
+            pad -= chunk;
         }
     }
+
+    template <typename T>
+    void write_compressed(T const* data, size_t n) {
+        write_padding<uint64_t>();
+        std::vector<uint8_t> encoded;
+        block_codec::encode(data, n, encoded);
+        uint64_t encoded_bytes = encoded.size();
+        write(reinterpret_cast<char const*>(&encoded_bytes), sizeof(encoded_bytes));
+        write(reinterpret_cast<char const*>(encoded.data()), encoded_bytes);
+        m_arena_bytes += arena_padding<T>(m_arena_bytes) + n * sizeof(T);
+    }
 };
 
-template <typename ClockType, typename DurationType>
-struct timer {
-    void start() { m_start = ClockType::now(); }
+struct saver : generic_saver {
+    saver(char const* filename, format_options const& opts = {})
+        : generic_saver(m_os, opts)
+        , m_os(filename, std::ios::binary) {
+        if (!m_os.good()) {
+            throw std::runtime_error(
+                "Error in opening binary "
+                "file.");
+        }
+    }
 
-    void stop() {
-        m_stop = ClockType::now();
-        auto elapsed = std::chrono::duration_cast<DurationType>(m_stop - m_start);
-        m_timings.push_back(elapsed.count());
+private:
+    std::ofstream m_os;
+};
+
+/*
+    Saver that writes large arrays concurrently.
+    The data structure is visited sequentially as with saver, except that payloads
+    of at least min_parallel_bytes are not written: the stream skips over them, so
+    that the file offset of every payload is known after the visit. Then,
+    write_deferred() writes them with pwrite() from num_threads threads.
+    The saved data must not be modified until write_deferred() returns.
+*/
+struct parallel_saver : saver {
+    parallel_saver(char const* filename, size_t num_threads, format_options const& opts = {},
+                   size_t min_parallel_bytes = 4 * MiB)
+        : saver(filename, opts)
+        , m_num_threads(num_threads)
+        , m_fd(::open(filename, O_WRONLY)) {
+        if (m_fd == -1) {
+            throw std::runtime_error(
+                "Error in opening binary "
+                "file.");
+        }
+        m_min_deferred_bytes = std::max<size_t>(min_parallel_bytes, 1);
     }
 
-    size_t runs() const { return m_timings.size(); }
+    ~parallel_saver() { ::close(m_fd); }
+
+    /* Write all deferred payloads. To be called after having visited the whole
+       data structure (and after write_header(), if any). */
+    void write_deferred() {
+        flush();
+        int fd = m_fd;
+        parallel_io(m_deferred, m_num_threads,
+                    [fd](char const* data, uint64_t offset, uint64_t num_bytes) {
+                        pwrite_all(fd, data, num_bytes, offset);
+                    });
+        m_deferred.clear();
+    }
 
-    void reset() { m_timings.clear(); }
+private:
+    size_t m_num_threads;
+    int m_fd;
+};
 
-    // double min() const {
-    //     return *std::min_element(m_timings.begin(), m_timings.end());
-    // }
+/* Options of async_saver. */
+struct async_save_options {
+    /* Serialized data is copied into one buffer while the others are being written. */
+    size_t num_buffers = 2;
+    size_t buffer_bytes = 8 * MiB;
 
-    // double max() const {
-    //     return *std::max_element(m_timings.begin(), m_timings.end());
-    // }
+    /* fdatasync() the file before renaming it into place, and fsync() its directory after. */
+    bool sync = true;
+};
 
-    void discard_first() {
-        if (runs()) {
-            m_timings.erase(m_timings.begin());
+/*
+    Stream buffer that hands full buffers to a background thread, which writes each of
+    them with pwrite() at the file offset where it begins. Seeking just starts a new
+    buffer, so that the header can be written at the beginning of the file once the
+    payloads are known. The file is written under a temporary name and renamed to
+    filename only after all writes succeeded, so that a crash or an error never leaves
+    a half-written file in place.
+*/
+struct async_file_buf : std::streambuf {
+    async_file_buf(char const* filename, async_save_options const& opts = {})
+        : m_filename(filename)
+        , m_opts(opts)
+        , m_base(0)
+        , m_current(0)
+        , m_closing(false)
+        , m_aborted(false)
+        , m_failed(false)
+        , m_done(false) {
+        m_opts.num_buffers = std::max<size_t>(m_opts.num_buffers, 1);
+        m_opts.buffer_bytes = std::min<size_t>(std::max<size_t>(m_opts.buffer_bytes, 1), GiB);
+        m_buffers.resize(m_opts.num_buffers);
+        for (auto& b : m_buffers) b.data.reset(new char[m_opts.buffer_bytes]);
+        for (size_t i = 1; i != m_buffers.size(); ++i) m_free.push_back(i);
+
+        static std::atomic<uint64_t> counter(0);
+        m_temp_filename = m_filename + ".tmp." + std::to_string(::getpid()) + "." +
+                          std::to_string(counter++);
+        m_fd = ::open(m_temp_filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (m_fd == -1) {
+            throw std::runtime_error(
+                "Error in opening binary "
+                "file.");
         }
+        setp(m_buffers[0].data.get(), m_buffers[0].data.get() + m_opts.buffer_bytes);
+        m_writer = std::thread([this] { write_loop(); });
     }
 
-    void discard_min() {
-        if (runs() > 1) {
-            m_timings.erase(std::min_element(m_timings.begin(), m_timings.end()));
+    /* If not closed, the temporary file is removed and filename is left untouched.
+       Otherwise, waits for the writes: errors are only reported by wait(). */
+    ~async_file_buf() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_closing) m_aborted = true;
         }
+        m_work.notify_one();
+        if (m_writer.joinable()) m_writer.join();
     }
 
-    void discard_max() {
-        if (runs() > 1) {
-            m_timings.erase(std::max_element(m_timings.begin(), m_timings.end()));
-        }
+    async_file_buf(async_file_buf const&) = delete;
+    async_file_buf& operator=(async_file_buf const&) = delete;
+
+    /* Hand the remaining data to the writer, which renames the file once written.
+       Does not wait for the writes: see wait(). */
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_closing) return;
+        enqueue();
+        setp(nullptr, nullptr);
+        m_closing = true;
+        m_work.notify_one();
     }
 
-    double elapsed() { return std::accumulate(m_timings.begin(), m_timings.end(), 0.0); }
+    /* Close, wait until the file is in place and rethrow the first error, if any. */
+    void wait() {
+        close();
+        if (m_writer.joinable()) m_writer.join();
+        if (m_error) std::rethrow_exception(m_error);
+    }
 
-    double average() { return elapsed() / runs(); }
+    /* Whether the writer is done, i.e., wait() would not block. */
+    bool done() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_done;
+    }
 
-private:
-    typename ClockType::time_point m_start;
-    typename ClockType::time_point m_stop;
-    std::vector<double> m_timings;
-};
+protected:
+    int_type overflow(int_type c) override {
+        if (!next_buffer(position())) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
 
-typedef std::chrono::high_resolution_clock clock_type;
-typedef std::chrono::microseconds duration_type;
-typedef timer<clock_type, duration_type> timer_type;
+    std::streamsize xsputn(char const* s, std::streamsize n) override {
+        std::streamsize written = 0;
+        while (written != n) {
+            if (pptr() == epptr() && !next_buffer(position())) break;
+            size_t chunk = std::min<size_t>(n - written, epptr() - pptr());
+            std::memcpy(pptr(), s + written, chunk);
+            pbump(static_cast<int>(chunk));
+            written += chunk;
+        }
+        return written;
+    }
 
-[[maybe_unused]] static unsigned get_random_seed() {
-    return std::chrono::system_clock::now().time_since_epoch().count();
-}
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::out)) return pos_type(off_type(-1));
+        off_type pos = static_cast<off_type>(position());
+        if (dir == std::ios_base::cur) {
+            if (off == 0) return pos_type(pos);  // tellp()
+            pos += off;
+        } else if (dir == std::ios_base::beg) {
+            pos = off;
+        } else {
+            return pos_type(off_type(-1));
+        }
+        if (pos < 0 || !next_buffer(pos)) return pos_type(off_type(-1));
+        return pos_type(pos);
+    }
 
-template <typename IntType>
-struct uniform_int_rng {
-    uniform_int_rng(IntType from, IntType to, unsigned seed = 13)
-        : m_rng(seed)
-        , m_distr(from, to) {}
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
 
-    IntType gen() { return m_distr(m_rng); }
+    int sync() override { return next_buffer(position()) ? 0 : -1; }
 
 private:
-    std::mt19937_64 m_rng;
-    std::uniform_int_distribution<IntType> m_distr;
-};
-
-struct generic_loader {
-    generic_loader(std::istream& is)
-        : m_num_bytes_pods(0)
-        , m_num_bytes_vecs_of_pods(0)
-        , m_is(is)
-        , m_mmap_base(nullptr)
-        , m_mmap_size(0)
-        , m_mmap_owner() {}
+    struct buffer {
+        std::unique_ptr<char[]> data;
+        uint64_t offset = 0;
+        size_t size = 0;
+    };
 
-    void set_mmap(uint8_t const* mmap_base, size_t mmap_size,
-                  std::shared_ptr<const void> owner = {})  //
-    {
-        m_mmap_base = mmap_base;
-        m_mmap_size = mmap_size;
-        m_mmap_owner = std::move(owner);
+    std::string m_filename;
+    std::string m_temp_filename;
+    async_save_options m_opts;
+    int m_fd;
+    std::vector<buffer> m_buffers;
+    uint64_t m_base;   // file offset of the current buffer
+    size_t m_current;  // index of the current buffer
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_work;       // signalled when m_queue grows or on close
+    std::condition_variable m_available;  // signalled when m_free grows
+    std::deque<size_t> m_queue;           // buffers to write, in order
+    std::vector<size_t> m_free;
+    bool m_closing;
+    bool m_aborted;
+    bool m_failed;
+    bool m_done;
+    std::exception_ptr m_error;  // set by the writer, read after joining it
+    std::thread m_writer;
+
+    uint64_t position() const { return m_base + (pptr() - pbase()); }
+
+    /* Queue the current buffer, if not empty. Requires m_mutex. */
+    bool enqueue() {
+        size_t size = pptr() - pbase();
+        if (pbase() == nullptr || size == 0) return false;
+        m_buffers[m_current].offset = m_base;
+        m_buffers[m_current].size = size;
+        m_queue.push_back(m_current);
+        m_work.notify_one();
+        return true;
     }
 
-    template <typename T>
-    void visit(T& val) {
-        if constexpr (is_pod<T>::value) {
-            load_pod(m_is, val);
-            m_num_bytes_pods += pod_bytes(val);
-        } else {
-            val.visit(*this);
+    /* Queue the current buffer and continue at file offset base, in a free buffer. */
+    bool next_buffer(uint64_t base) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_closing) return false;
+        if (enqueue()) {
+            m_available.wait(lock, [&] { return !m_free.empty(); });
+            m_current = m_free.back();
+            m_free.pop_back();
         }
+        m_base = base;
+        char* data = m_buffers[m_current].data.get();
+        setp(data, data + m_opts.buffer_bytes);
+        return !m_failed;
     }
 
-    template <typename T, typename Allocator>
-    void visit(std::vector<T, Allocator>& vec) {
-        assert(!is_mmap());
-        size_t n;
-        visit(n);
-        vec.resize(n);
-        if constexpr (is_pod<T>::value) {
-            m_is.read(reinterpret_cast<char*>(vec.data()),
-                      static_cast<std::streamsize>(sizeof(T) * n));
-            m_num_bytes_vecs_of_pods += n * sizeof(T);
-        } else {
-            for (auto& v : vec) visit(v);
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_work.wait(lock, [&] { return !m_queue.empty() || m_closing || m_aborted; });
+            if (m_aborted || m_queue.empty()) break;
+            size_t i = m_queue.front();
+            m_queue.pop_front();
+            bool failed = m_failed;
+            lock.unlock();
+            if (!failed) {
+                try {
+                    pwrite_all(m_fd, m_buffers[i].data.get(), m_buffers[i].size,
+                               m_buffers[i].offset);
+                } catch (...) {
+                    m_error = std::current_exception();
+                    failed = true;
+                }
+            }
+            lock.lock();
+            m_failed = failed;
+            m_free.push_back(i);
+            m_available.notify_one();
         }
+        bool commit = !m_aborted && !m_failed;
+        lock.unlock();
+
+        if (commit) {
+            try {
+                rename_into_place();
+            } catch (...) {
+                m_error = std::current_exception();
+                commit = false;
+            }
+        }
+        if (!commit) {
+            if (m_fd != -1) ::close(m_fd);
+            ::unlink(m_temp_filename.c_str());
+        }
+        m_fd = -1;
+
+        lock.lock();
+        m_done = true;
     }
 
-    template <typename T>
-    void visit(owning_span<T>& vec) {
-        size_t n;
-        visit(n);
-        if constexpr (is_pod<T>::value) {
-            m_num_bytes_vecs_of_pods += n * sizeof(T);
-            if (is_mmap()) {
-                size_t offset = static_cast<size_t>(m_is.tellg());
-                vec = owning_span<T>(reinterpret_cast<T const*>(m_mmap_base + offset), n,
-                                     m_mmap_owner);
-                m_is.seekg(static_cast<std::streamoff>(offset + n * sizeof(T)));
-            } else {
-                std::vector<T> tmp(n);
-                m_is.read(reinterpret_cast<char*>(tmp.data()),
-                          static_cast<std::streamsize>(n * sizeof(T)));
-                vec = std::move(tmp);
+    void rename_into_place() {
+        if (m_opts.sync && ::fdatasync(m_fd) != 0) throw std::runtime_error("fdatasync failed");
+        int ret = ::close(m_fd);
+        m_fd = -1;
+        if (ret != 0) throw std::runtime_error("close failed");
+        if (::rename(m_temp_filename.c_str(), m_filename.c_str()) != 0) {
+            throw std::runtime_error("rename failed");
+        }
+        if (m_opts.sync) {
+            /* make the rename itself durable */
+            size_t slash = m_filename.find_last_of('/');
+            std::string dir = slash == std::string::npos ? "." : m_filename.substr(0, slash + 1);
+            int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd != -1) {
+                ::fsync(fd);
+                ::close(fd);
             }
-        } else {
-            std::vector<T> tmp(n);
-            for (auto& v : tmp) visit(v);
-            vec = std::move(tmp);
         }
     }
+};
 
-    size_t bytes() { return m_is.tellg(); }
-    size_t bytes_pods() { return m_num_bytes_pods; }
-    size_t bytes_vecs_of_pods() { return m_num_bytes_vecs_of_pods; }
-    bool is_mmap() const { return m_mmap_base != nullptr; }
+/*
+    Saver that overlaps serialization with I/O: the data structure is copied into
+    a pool of buffers written by a background thread (see async_file_buf), so that
+    the visited data can be modified or freed right after the visit.
+    close() returns without waiting for the writes, while wait() blocks until the file
+    is in place and rethrows any I/O error. If the saver is destroyed before close(),
+    e.g. because the visit threw, filename is left untouched.
+*/
+struct async_saver : generic_saver {
+    async_saver(char const* filename, format_options const& opts = {},
+                async_save_options const& async = {})
+        : generic_saver(m_os, opts)
+        , m_buf(filename, async)
+        , m_os(&m_buf)
+        , m_bytes(0)
+        , m_closed(false) {}
+
+    /* To be called after having visited the whole data structure
+       (and after write_header(), if any). */
+    void close() {
+        if (m_closed) return;
+        m_bytes = bytes();
+        m_closed = true;
+        m_buf.close();
+    }
+
+    /* Return the number of bytes written. */
+    size_t wait() {
+        close();
+        m_buf.wait();
+        if (!m_os.good()) throw std::runtime_error("async_saver: write failed");
+        return m_bytes;
+    }
+
+    bool done() const { return m_buf.done(); }
 
 private:
-    size_t m_num_bytes_pods;
-    size_t m_num_bytes_vecs_of_pods;
-    std::istream& m_is;
-    uint8_t const* m_mmap_base;
-    size_t m_mmap_size;
-    std::shared_ptr<const void> m_mmap_owner;
+    async_file_buf m_buf;
+    std::ostream m_os;
+    size_t m_bytes;
+    bool m_closed;
 };
 
-struct loader : generic_loader {
-    loader(char const* filename)
-        : generic_loader(m_is)
-        , m_is(filename, std::ios::binary) {
-        if (!m_is.good()) {
+/*
+    Builds a file in the saver format directly in a writable shared mapping of the
+    file, grown with ftruncate() and mremap() as data is appended. Data structures
+    larger than RAM can thus be built on disk, since the mapped pages can be written
+    back and evicted by the kernel, and then opened with mmap() or load().
+
+    Values are appended in the order in which a visitor would meet them: PODs and
+    whole arrays with append(), whole data structures with visit(), and arrays whose
+    size is not known in advance with begin_array(). This returns an array_builder
+    to push_back() elements into, whose close() writes the size of the array:
+    nothing else can be appended while an array is open, and the array_builder must
+    not outlive its mmap_builder.
+    close() writes the header, if any, and truncates the file to its final size.
+    A builder destroyed before close(), e.g. because building threw, removes the
+    file instead, so that no incomplete file is left behind.
+    Compression is not supported (compressed_spans are written as they are).
+*/
+struct mmap_builder {
+    mmap_builder(char const* filename, format_options const& opts = {},
+                 size_t initial_bytes = 1 * MiB)
+        : m_filename(filename)
+        , m_fd(::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644))
+        , m_data(nullptr)
+        , m_capacity(0)
+        , m_offset(0)
+        , m_arena_bytes(0)
+        , m_array_open(false)
+        , m_opts(opts) {
+        if (m_fd == -1) {
             throw std::runtime_error(
                 "Error in opening binary "
                 "file.");
         }
+        try {
+            m_opts.validate();
+            if (m_opts.compress) {
+                throw std::runtime_error("mmap_builder: compression is not supported");
+            }
+            grow(std::max<size_t>(initial_bytes, sizeof(file_header)));
+        } catch (...) {
+            ::close(m_fd);
+            ::unlink(filename);
+            throw;
+        }
+        if (m_opts.header) m_offset += sizeof(file_header);  // written by close()
     }
 
-private:
-    std::ifstream m_is;
-};
+    mmap_builder(mmap_builder const&) = delete;
+    mmap_builder& operator=(mmap_builder const&) = delete;
 
-struct generic_saver {
-    generic_saver(std::ostream& os)
-        : m_os(os) {}
+    ~mmap_builder() {
+        if (m_fd == -1) return;
+        if (m_data != nullptr) ::munmap(m_data, m_capacity);
+        ::close(m_fd);
+        ::unlink(m_filename.c_str());
+    }
+
+    template <typename T>
+    struct array_builder {
+        array_builder(array_builder&& other)
+            : m_builder(other.m_builder)
+            , m_size_offset(other.m_size_offset)
+            , m_size(other.m_size) {
+            other.m_builder = nullptr;
+        }
+
+        array_builder(array_builder const&) = delete;
+        array_builder& operator=(array_builder const&) = delete;
+
+        ~array_builder() { close(); }
+
+        void push_back(T const& val) {
+            check_open();
+            std::memcpy(m_builder->reserve(sizeof(T)), &val, sizeof(T));
+            m_builder->m_offset += sizeof(T);
+            ++m_size;
+        }
+
+        void append(T const* data, size_t n) {
+            check_open();
+            if (n == 0) return;
+            std::memcpy(m_builder->reserve(n * sizeof(T)), data, n * sizeof(T));
+            m_builder->m_offset += n * sizeof(T);
+            m_size += n;
+        }
+
+        size_t size() const { return m_size; }
+
+        /* The elements pushed so far. Invalidated when the mapping grows. */
+        T* data() {
+            check_open();
+            size_t payload = m_size_offset + sizeof(size_t);
+            return reinterpret_cast<T*>(m_builder->m_data + payload +
+                                        m_builder->m_opts.padding<T>(payload));
+        }
+
+        /* Write the size of the array, so that other values can be appended. */
+        void close() {
+            if (m_builder == nullptr) return;
+            std::memcpy(m_builder->m_data + m_size_offset, &m_size, sizeof(m_size));
+            size_t& arena_bytes = m_builder->m_arena_bytes;
+            arena_bytes += arena_padding<T>(arena_bytes) + m_size * sizeof(T);
+            m_builder->m_array_open = false;
+            m_builder = nullptr;
+        }
+
+    private:
+        friend struct mmap_builder;
+
+        array_builder(mmap_builder* builder, size_t size_offset)
+            : m_builder(builder)
+            , m_size_offset(size_offset)
+            , m_size(0) {}
+
+        mmap_builder* m_builder;  // null once closed or moved from
+        size_t m_size_offset;
+        size_t m_size;
+
+        void check_open() const {
+            if (m_builder == nullptr) throw std::runtime_error("array_builder: closed");
+        }
+    };
+
+    template <typename T>
+    void append(T const& val) {
+        static_assert(is_pod<T>::value);
+        write(&val, sizeof(T));
+    }
+
+    /* Append an array: its size, the padding and the n values. */
+    template <typename T>
+    void append(T const* data, size_t n) {
+        begin_array<T>().append(data, n);
+    }
+
+    template <typename T>
+    array_builder<T> begin_array() {
+        static_assert(is_pod<T>::value);
+        size_t size_offset = m_offset;
+        size_t n = 0;
+        write(&n, sizeof(n));
+        write_padding<T>();
+        m_array_open = true;
+        return array_builder<T>(this, size_offset);
+    }
 
     template <typename T>
     void visit(T const& val) {
         if constexpr (is_pod<T>::value) {
-            save_pod(m_os, val);
+            append(val);
         } else {
             val.visit(*this);
         }
@@ -444,40 +3736,111 @@ struct generic_saver {
         visit_seq(vec);
     }
 
-    size_t bytes() { return m_os.tellp(); }
+    template <typename T>
+    void visit(compressed_span<T> const& span) {
+        append(span.size());
+        write_padding<uint64_t>();
+        uint64_t encoded_bytes = span.encoded_bytes();
+        append(encoded_bytes);
+        write(span.encoded(), encoded_bytes);
+        m_arena_bytes += arena_padding<uint64_t>(m_arena_bytes) + encoded_bytes;
+    }
+
+    size_t bytes() const { return m_offset; }
+
+    /* Write the dirty pages back to the file. */
+    void flush() {
+        if (m_data != nullptr && ::msync(m_data, m_capacity, MS_SYNC) != 0) {
+            throw std::runtime_error("msync failed");
+        }
+    }
+
+    /* Finish the file, whose header, if any, records the given layout hash
+       (that of the built type, see layout_hash()). Return the size of the file. */
+    size_t close(uint64_t layout_hash) {
+        if (m_fd == -1) return m_offset;
+        if (m_array_open) throw std::runtime_error("mmap_builder: an array is still open");
+        if (m_opts.header) {
+            size_t payload_bytes = m_offset - sizeof(file_header);
+            auto header = file_header::make(
+                m_opts.alignment, layout_hash, payload_bytes,
+                crc32c(m_data + sizeof(file_header), payload_bytes), m_arena_bytes);
+            std::memcpy(m_data, &header, sizeof(header));
+        }
+        ::munmap(m_data, m_capacity);
+        m_data = nullptr;
+        if (::ftruncate(m_fd, static_cast<off_t>(m_offset)) != 0) {
+            throw std::runtime_error("ftruncate failed");  // the destructor removes the file
+        }
+        ::close(m_fd);
+        m_fd = -1;
+        return m_offset;
+    }
 
 private:
-    std::ostream& m_os;
+    std::string m_filename;
+    int m_fd;
+    uint8_t* m_data;
+    size_t m_capacity;
+    size_t m_offset;
+    size_t m_arena_bytes;
+    bool m_array_open;
+    format_options m_opts;
+
+    /* Return the address of the next num_bytes, growing the file if needed. */
+    uint8_t* reserve(size_t num_bytes) {
+        if (m_offset + num_bytes > m_capacity) grow(m_offset + num_bytes);
+        return m_data + m_offset;
+    }
+
+    void grow(size_t min_capacity) {
+        size_t page_bytes = sysconf(_SC_PAGESIZE);
+        size_t capacity = std::max(min_capacity, 2 * m_capacity);
+        capacity = (capacity + page_bytes - 1) / page_bytes * page_bytes;
+        if (::ftruncate(m_fd, static_cast<off_t>(capacity)) != 0) {
+            throw std::runtime_error("ftruncate failed");
+        }
+        void* addr = MAP_FAILED;
+#ifdef MREMAP_MAYMOVE
+        if (m_data != nullptr) addr = ::mremap(m_data, m_capacity, capacity, MREMAP_MAYMOVE);
+#endif
+        if (addr == MAP_FAILED) {
+            if (m_data != nullptr) ::munmap(m_data, m_capacity);
+            m_data = nullptr;
+            addr = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+            if (addr == MAP_FAILED) throw std::runtime_error("mmap failed");
+        }
+        m_data = static_cast<uint8_t*>(addr);
+        m_capacity = capacity;
+    }
+
+    void write(void const* data, size_t num_bytes) {
+        if (m_array_open) throw std::runtime_error("mmap_builder: an array is still open");
+        if (num_bytes == 0) return;
+        std::memcpy(reserve(num_bytes), data, num_bytes);
+        m_offset += num_bytes;
+    }
+
+    /* The file is zero-filled by ftruncate(): padding is skipped over. */
+    template <typename T>
+    void write_padding() {
+        size_t pad = m_opts.padding<T>(m_offset);
+        reserve(pad);
+        m_offset += pad;
+    }
 
     template <typename Vec>
     void visit_seq(Vec const& vec) {
         using T = typename Vec::value_type;
-        size_t n = vec.size();
-        visit(n);
         if constexpr (is_pod<T>::value) {
-            m_os.write(reinterpret_cast<char const*>(vec.data()),
-                       static_cast<std::streamsize>(sizeof(T) * n));
+            append(vec.data(), vec.size());
         } else {
+            append(vec.size());
             for (auto const& v : vec) visit(v);
         }
     }
 };
 
-struct saver : generic_saver {
-    saver(char const* filename)
-        : generic_saver(m_os)
-        , m_os(filename, std::ios::binary) {
-        if (!m_os.good()) {
-            throw std::runtime_error(
-                "Error in opening binary "
-                "file.");
-        }
-    }
-
-private:
-    std::ofstream m_os;
-};
-
 [[maybe_unused]] static std::string demangle(char const* mangled_name) {
     size_t len = 0;
     int status = 0;
@@ -486,29 +3849,69 @@ private:
     return ptr.get();
 }
 
+/*
+    Computes the space breakdown of a data structure as a tree of nodes.
+
+    By default, every element of a sequence of non-POD types gets its own node.
+    With aggregate = true, the elements of such sequences are instead merged into
+    a single node recording their count and the minimum, maximum, and average
+    bytes per element: the size of the tree then depends on the types only,
+    not on the number of elements.
+*/
 struct sizer {
-    sizer(std::string const& root_name = "")
+    sizer(std::string const& root_name = "", format_options const& opts = {},
+          bool aggregate = false)
         : m_root(0, 0, root_name)
-        , m_current(&m_root) {}
+        , m_current(&m_root)
+        , m_offset(0)
+        , m_opts(opts)
+        , m_aggregate(aggregate) {
+        m_opts.validate();
+        m_root.elements = m_root.count = 1;
+        if (m_opts.header) add_leaf(type_name<file_header>(), sizeof(file_header));
+    }
 
     struct node {
         node(size_t b, size_t d, std::string const& n = "")
             : bytes(b)
             , depth(d)
-            , name(n) {}
+            , name(n)
+            , elements(0)
+            , count(0)
+            , min_bytes(0)
+            , max_bytes(0)
+            , cursor(0) {}
+
+        size_t bytes;
+        size_t depth;
+        std::string name;
+        std::vector<node> children;
+
+        /* Number of values: elements of sequences, or 1 for other values. */
+        size_t elements;
+        double bits_per_element() const { return elements ? bytes * 8.0 / elements : 0.0; }
+
+        /* Number of occurrences (elements) summarized by this node and bytes per occurrence. */
+        size_t count;
+        size_t min_bytes;
+        size_t max_bytes;
+        double avg_bytes() const { return count ? static_cast<double>(bytes) / count : 0.0; }
+
+    private:
+        friend struct sizer;
+        size_t cursor;  // next child to visit
 
-        size_t bytes;
-        size_t depth;
-        std::string name;
-        std::vector<node> children;
+        void record(size_t occurrence_bytes) {
+            min_bytes = count ? std::min(min_bytes, occurrence_bytes) : occurrence_bytes;
+            max_bytes = std::max(max_bytes, occurrence_bytes);
+            ++count;
+        }
     };
 
     template <typename T>
     void visit(T& val) {
         if constexpr (is_pod<T>::value) {
-            node n(pod_bytes(val), m_current->depth + 1, demangle(typeid(T).name()));
-            m_current->children.push_back(n);
-            m_current->bytes += n.bytes;
+            add_leaf(type_name<T>(), pod_bytes(val));
         } else {
             val.visit(*this);
         }
@@ -524,11 +3927,24 @@ struct sizer {
         visit_seq(vec);
     }
 
+    template <typename T>
+    void visit(compressed_span<T>& span) {
+        size_t offset = m_offset + sizeof(size_t);
+        size_t bytes = sizeof(size_t) + m_opts.padding<uint64_t>(offset) + sizeof(uint64_t) +
+                       span.encoded_bytes();
+        add_leaf(type_name<compressed_span<T>>(), bytes, span.size());
+    }
+
     template <typename Device>
     void print(node const& n, size_t total_bytes, Device& device) const {
         auto indent = std::string(n.depth * 4, ' ');
         device << indent << "'" << n.name << "' - bytes = " << n.bytes << " ("
-               << n.bytes * 100.0 / total_bytes << "%)" << std::endl;
+               << n.bytes * 100.0 / total_bytes << "%)";
+        if (n.count > 1) {
+            device << " - count = " << n.count << ", bytes per element: avg = " << n.avg_bytes()
+                   << ", min = " << n.min_bytes << ", max = " << n.max_bytes;
+        }
+        device << std::endl;
         for (auto const& child : n.children) {
             device << indent;
             print(child, total_bytes, device);
@@ -542,29 +3958,147 @@ struct sizer {
 
     size_t bytes() const { return m_root.bytes; }
 
+    node const& root() const { return m_root; }
+
+    /*
+        Add one line per node to jl, in depth-first order. A node is identified
+        by its path: the names of the nodes from the root, each followed by its
+        position among its siblings, separated by '/'.
+    */
+    template <typename JsonLines>
+    void add_to(JsonLines& jl) const {
+        std::string path = m_root.name;
+        add_to(m_root, path, jl);
+    }
+
+    /*
+        Print the tree in the folded-stack format of flamegraph.pl: one line per
+        node whose bytes are not all accounted by its children, e.g., by the size
+        of a sequence, with the frames separated by ';' followed by those bytes.
+    */
+    template <typename Device>
+    void print_folded(Device& device) const {
+        std::string stack = m_root.name;
+        print_folded(m_root, stack, device);
+    }
+
 private:
     node m_root;
     node* m_current;
+    size_t m_offset;
+    format_options m_opts;
+    bool m_aggregate;
+
+    static void append_component(std::string& path, node const& child, size_t i,
+                                 char separator) {
+        path.push_back(separator);
+        path.append(child.name).push_back('[');
+        path.append(std::to_string(i)).push_back(']');
+    }
+
+    template <typename JsonLines>
+    void add_to(node const& n, std::string& path, JsonLines& jl) const {
+        jl.new_line();
+        jl.add("path", path.c_str());
+        jl.add("type", n.name.c_str());
+        jl.add("depth", n.depth);
+        jl.add("bytes", n.bytes);
+        jl.add("fraction", bytes() ? static_cast<double>(n.bytes) / bytes() : 0.0);
+        jl.add("elements", n.elements);
+        jl.add("bits_per_element", n.bits_per_element());
+        if (m_aggregate) jl.add("count", n.count);
+        for (size_t i = 0; i != n.children.size(); ++i) {
+            size_t size = path.size();
+            append_component(path, n.children[i], i, '/');
+            add_to(n.children[i], path, jl);
+            path.resize(size);
+        }
+    }
+
+    template <typename Device>
+    void print_folded(node const& n, std::string& stack, Device& device) const {
+        size_t self_bytes = n.bytes;
+        for (auto const& child : n.children) self_bytes -= child.bytes;
+        if (self_bytes) device << stack << ' ' << self_bytes << '\n';
+        for (size_t i = 0; i != n.children.size(); ++i) {
+            size_t size = stack.size();
+            append_component(stack, n.children[i], i, ';');
+            print_folded(n.children[i], stack, device);
+            stack.resize(size);
+        }
+    }
+
+    /* Demangled names are computed once per type. */
+    template <typename T>
+    static std::string const& type_name() {
+        static const std::string name = demangle(typeid(T).name());
+        return name;
+    }
+
+    /*
+        The child of m_current for the next visited value. When a node is visited
+        again for another element, its existing children are reused in order: the
+        values visited are the same, since the type is the same.
+    */
+    node& next_child(std::string const& name) {
+        auto& children = m_current->children;
+        if (m_current->cursor == children.size()) {
+            children.emplace_back(0, m_current->depth + 1, name);
+        }
+        node& n = children[m_current->cursor++];
+        n.cursor = 0;
+        return n;
+    }
+
+    void add_leaf(std::string const& name, size_t bytes, size_t elements = 1) {
+        node& n = next_child(name);
+        n.bytes += bytes;
+        n.elements += elements;
+        n.record(bytes);
+        m_current->bytes += bytes;
+        m_offset += bytes;
+    }
+
+    template <typename T>
+    void visit_element(node& n, T& val) {
+        node* parent = m_current;
+        size_t bytes = n.bytes;
+        m_current = &n;
+        n.cursor = 0;
+        visit(val);
+        bytes = n.bytes - bytes;
+        n.record(bytes);
+        n.elements += 1;
+        m_current = parent;
+        parent->bytes += bytes;
+    }
 
     template <typename Vec>
     void visit_seq(Vec& vec) {
         using T = typename Vec::value_type;
         if constexpr (is_pod<T>::value) {
-            node n(vec_bytes(vec), m_current->depth + 1, demangle(typeid(Vec).name()));
-            m_current->children.push_back(n);
-            m_current->bytes += n.bytes;
+            size_t offset = m_offset + sizeof(typename Vec::size_type);
+            if constexpr (block_codec::compressible<T>) {
+                if (m_opts.compress) {
+                    size_t bytes = m_opts.padding<uint64_t>(offset) + sizeof(uint64_t) +
+                                   block_codec::encoded_bytes(vec.data(), vec.size());
+                    add_leaf(type_name<Vec>(), sizeof(typename Vec::size_type) + bytes,
+                             vec.size());
+                    return;
+                }
+            }
+            size_t pad = m_opts.padding<T>(offset);
+            add_leaf(type_name<Vec>(), vec_bytes(vec) + pad, vec.size());
         } else {
             size_t n = vec.size();
             m_current->bytes += pod_bytes(n);
-            node* parent = m_current;
-            for (auto& v : vec) {
-                node nd(0, parent->depth + 1, demangle(typeid(T).name()));
-                parent->children.push_back(nd);
-                m_current = &parent->children.back();
-                visit(v);
-                parent->bytes += m_current->bytes;
+            m_offset += pod_bytes(n);
+            if (m_aggregate) {
+                node& agg = next_child(type_name<T>());
+                for (auto& v : vec) visit_element(agg, v);
+            } else {
+                for (auto& v : vec) visit_element(next_child(type_name<T>()), v);
             }
-            m_current = parent;
         }
     }
 };
@@ -573,6 +4107,12 @@ template <typename T>
 struct allocator : std::allocator<T> {
     typedef T value_type;
 
+    /* std::allocator<T>::rebind (C++17) would otherwise rebind to std::allocator. */
+    template <typename U>
+    struct rebind {
+        typedef allocator<U> other;
+    };
+
     allocator()
         : m_addr(nullptr) {}
 
@@ -593,30 +4133,265 @@ private:
 };
 
 struct contiguous_memory_allocator {
+    /*
+        Options for the memory backing the arena.
+
+        huge_pages: back the arena with huge pages (MAP_HUGETLB) if any are reserved,
+        otherwise with 2 MiB-aligned memory advised with MADV_HUGEPAGE so that
+        transparent huge pages can be used.
+
+        numa_node: if non-negative, bind the arena to this NUMA node with mbind().
+        Binding is best-effort: see numa_bound().
+    */
+    struct arena_options {
+        bool huge_pages = false;
+        int numa_node = -1;
+    };
+
+    /*
+        Options for reading arrays into the arena.
+
+        num_threads: if non-zero, arrays of at least min_parallel_bytes are read with
+        pread() from num_threads threads once the data structure has been visited,
+        as with parallel_loader. Otherwise, all arrays are read sequentially.
+
+        direct: read those arrays with O_DIRECT (see pread_file and direct_io()).
+        Arrays of at least min_placed_bytes are then placed in the arena at an address
+        congruent to their file offset modulo direct_io_alignment, so that they are read
+        straight into the arena rather than through a bounce buffer. This costs less than
+        direct_io_alignment bytes per such array, i.e., at most 0.4% of the arena.
+    */
+    struct io_options {
+        size_t num_threads = 0;
+        size_t min_parallel_bytes = 4 * MiB;
+        bool direct = false;
+    };
+
+    static constexpr size_t min_placed_bytes = 1 * MiB;
+
     contiguous_memory_allocator()
         : m_begin(nullptr)
         , m_end(nullptr)
-        , m_size(0) {}
-
-    struct visitor {
-        visitor(uint8_t* begin, size_t size, char const* filename)
-            : m_begin(begin)
-            , m_end(begin)
-            , m_size(size)
+        , m_size(0)
+        , m_mapped_bytes(0)
+        , m_huge_pages(false)
+        , m_numa_bound(false)
+        , m_direct_io(false) {}
+
+    /* Common state of prescan and visitor: reads the file, following format_options. */
+    struct reader {
+        reader(char const* filename, format_options const& opts)
+            : m_offset(0)
+            , m_checksum(0)
+            , m_opts(opts)
+            , m_header()
             , m_is(filename, std::ios::binary) {
             if (!m_is.good()) {
                 throw std::runtime_error(
                     "Error in opening binary "
                     "file.");
             }
+            m_file_size = file_size(filename);
+            m_opts.validate();
+            if (m_opts.header) {
+                read(reinterpret_cast<char*>(&m_header), sizeof(m_header));
+                if (!m_is.good()) throw std::runtime_error("file_header: file too short");
+                m_header.validate();
+                m_opts.alignment = m_header.alignment;
+                m_opts.compress = m_header.compressed();
+                m_opts.validate();
+                m_checksum = 0;
+            }
+        }
+
+        ~reader() { m_is.close(); }
+
+        void check_layout(uint64_t layout_hash) const {
+            if (m_opts.header) m_header.check_layout(layout_hash);
+        }
+
+        /* Arena size recorded in the header, if any. */
+        bool has_arena_bytes() const { return m_opts.header && m_header.has_arena_bytes(); }
+        size_t header_arena_bytes() const { return m_header.arena_bytes; }
+
+        void check_checksum() const {
+            if (!m_opts.header) return;
+            if (m_offset != sizeof(m_header) + m_header.payload_bytes) {
+                throw std::runtime_error("file_header: payload size mismatch");
+            }
+            if (m_opts.verify_checksum) m_header.check_checksum(m_checksum);
+        }
+
+        size_t bytes() const { return m_offset; }
+
+    protected:
+        size_t m_offset;
+        uint32_t m_checksum;
+        format_options m_opts;
+        file_header m_header;
+        std::ifstream m_is;
+        size_t m_file_size;
+
+        /* Throw if fewer than num_bytes are left in the file. Checked before allocating
+           or reserving arena space for a size read from the file. */
+        void check_remaining(uint64_t num_bytes) const {
+            if (m_offset > m_file_size || num_bytes > m_file_size - m_offset) {
+                throw std::runtime_error("unexpected end of file");
+            }
+        }
+
+        void read(char* data, size_t num_bytes) {
+            m_is.read(data, static_cast<std::streamsize>(num_bytes));
+            if (m_opts.verify_checksum) m_checksum = crc32c(data, num_bytes, m_checksum);
+            m_offset += num_bytes;
+        }
+
+        template <typename T>
+        void read_pod(T& val) {
+            static_assert(is_pod<T>::value);
+            read(reinterpret_cast<char*>(&val), sizeof(T));
+        }
+
+        template <typename T>
+        void skip_padding() {
+            char padding[64];
+            for (size_t pad = m_opts.padding<T>(m_offset); pad != 0;) {
+                size_t chunk = std::min<size_t>(pad, sizeof(padding));
+                read(padding, chunk);
+                pad -= chunk;
+            }
+        }
+
+        template <typename T>
+        bool compressed() const {
+            if constexpr (block_codec::compressible<T>) return m_opts.compress;
+            return false;
+        }
+
+        /* Skip the padding before the payload of a sequence of T, if any. */
+        template <typename T>
+        void skip_payload_padding() {
+            if (compressed<T>()) {
+                skip_padding<uint64_t>();
+            } else {
+                skip_padding<T>();
+            }
+        }
+
+        /* Read the payload of n values of T, after its padding. */
+        template <typename T>
+        void read_payload(T* data, size_t n) {
+            if constexpr (block_codec::compressible<T>) {
+                if (m_opts.compress) {
+                    uint64_t encoded_bytes;
+                    read_pod(encoded_bytes);
+                    check_remaining(encoded_bytes);
+                    std::vector<uint8_t> encoded(encoded_bytes);
+                    read(reinterpret_cast<char*>(encoded.data()), encoded_bytes);
+                    if (!m_is.good()) throw std::runtime_error("unexpected end of file");
+                    block_codec::decode(encoded.data(), encoded_bytes, data, n);
+                    return;
+                }
+            }
+            read(reinterpret_cast<char*>(data), sizeof(T) * n);
+        }
+
+        /* Seek over the payload of n values of T, after its padding. */
+        template <typename T>
+        void skip_payload(size_t n) {
+            size_t num_bytes = sizeof(T) * n;
+            if (compressed<T>()) {
+                uint64_t encoded_bytes;
+                read_pod(encoded_bytes);
+                check_remaining(encoded_bytes);
+                num_bytes = encoded_bytes;
+            }
+            m_is.seekg(static_cast<std::streamoff>(num_bytes), std::ios::cur);
+            m_offset += num_bytes;
+        }
+    };
+
+    /*
+        Prescan computing the size of the arena in a single pass over the file
+        that reads sizes and PODs only, seeking over the payloads of arrays.
+        Non-POD elements are visited through a single temporary object.
+    */
+    struct prescan : reader {
+        prescan(char const* filename, format_options const& opts = {})
+            : reader(filename, opts)
+            , m_arena_bytes(0) {}
+
+        template <typename T>
+        void visit(T& val) {
+            if constexpr (is_pod<T>::value) {
+                read_pod(val);
+            } else {
+                val.visit(*this);
+            }
+        }
+
+        template <typename T, typename Allocator>
+        void visit(std::vector<T, Allocator>&) {
+            visit_seq<T>();
+        }
+
+        template <typename T>
+        void visit(owning_span<T>&) {
+            visit_seq<T>();
+        }
+
+        template <typename T>
+        void visit(compressed_span<T>&) {
+            size_t n;
+            read_pod(n);
+            skip_padding<uint64_t>();
+            uint64_t encoded_bytes;
+            read_pod(encoded_bytes);
+            check_remaining(encoded_bytes);
+            m_is.seekg(static_cast<std::streamoff>(encoded_bytes), std::ios::cur);
+            m_offset += encoded_bytes;
+            m_arena_bytes += arena_padding<uint64_t>(m_arena_bytes) + encoded_bytes;
+        }
+
+        size_t arena_bytes() const { return m_arena_bytes; }
+
+    private:
+        size_t m_arena_bytes;
+
+        template <typename T>
+        void visit_seq() {
+            size_t n;
+            read_pod(n);
+            if constexpr (is_pod<T>::value) {
+                skip_payload_padding<T>();
+                skip_payload<T>(n);
+                m_arena_bytes += arena_padding<T>(m_arena_bytes) + n * sizeof(T);
+            } else {
+                T tmp;
+                for (size_t i = 0; i != n; ++i) visit(tmp);
+            }
         }
+    };
+
+    struct visitor : reader {
+        visitor(uint8_t* begin, size_t size, char const* filename,
+                format_options const& opts = {})
+            : visitor(begin, size, filename, opts, io_options()) {}
 
-        ~visitor() { m_is.close(); }
+        visitor(uint8_t* begin, size_t size, char const* filename,
+                format_options const& opts, io_options const& io)
+            : reader(filename, opts)
+            , m_begin(begin)
+            , m_end(begin)
+            , m_size(size)
+            , m_min_deferred_bytes(io.num_threads != 0 ? std::max<size_t>(io.min_parallel_bytes, 1)
+                                                       : 0)
+            , m_direct(io.num_threads != 0 && io.direct) {}
 
         template <typename T>
         void visit(T& val) {
             if constexpr (is_pod<T>::value) {
-                load_pod(m_is, val);
+                read_pod(val);
             } else {
                 val.visit(*this);
             }
@@ -625,12 +4400,14 @@ struct contiguous_memory_allocator {
         template <typename T, typename Allocator>
         void visit(std::vector<T, Allocator>& vec) {
             if constexpr (is_pod<T>::value) {
-                vec = std::vector<T, Allocator>(make_allocator<T>());
                 size_t n;
-                load_pod(m_is, n);
+                read_pod(n);
+                skip_payload_padding<T>();
+                align<T>();
+                place<T>(n);
+                vec = std::vector<T, Allocator>(make_allocator<T>());
                 vec.resize(n);
-                m_is.read(reinterpret_cast<char*>(vec.data()),
-                          static_cast<std::streamsize>(sizeof(T) * n));
+                read_or_defer(vec.data(), n);
                 consume(vec.size() * sizeof(T));
             } else {
                 size_t n;
@@ -640,21 +4417,62 @@ struct contiguous_memory_allocator {
             }
         }
 
+        /* Spans of PODs are read straight into the arena and are views into it:
+           the arena is owned by the allocator, hence lives as long as the data structure. */
         template <typename T>
         void visit(owning_span<T>& vec) {
             size_t n;
-            load_pod(m_is, n);
-            std::vector<T> tmp(n);
-            m_is.read(reinterpret_cast<char*>(tmp.data()),
-                      static_cast<std::streamsize>(sizeof(T) * n));
-            consume(n * sizeof(T));
-            vec = owning_span<T>(std::move(tmp));
+            read_pod(n);
+            if constexpr (is_pod<T>::value) {
+                skip_payload_padding<T>();
+                align<T>();
+                if (m_end == nullptr) {
+                    std::vector<T> tmp(n);
+                    read_payload(tmp.data(), n);
+                    vec = owning_span<T>(std::move(tmp));
+                } else {
+                    place<T>(n);
+                    T* data = reinterpret_cast<T*>(m_end);
+                    consume(n * sizeof(T));
+                    read_or_defer(data, n);
+                    vec = owning_span<T>(data, n);
+                }
+            } else {
+                std::vector<T> tmp(n);
+                for (auto& v : tmp) visit(v);
+                vec = owning_span<T>(std::move(tmp));
+            }
+        }
+
+        /* The encoding is read into the arena and the span is a view into it. */
+        template <typename T>
+        void visit(compressed_span<T>& span) {
+            size_t n;
+            read_pod(n);
+            skip_padding<uint64_t>();
+            uint64_t encoded_bytes;
+            read_pod(encoded_bytes);
+            check_remaining(encoded_bytes);
+            align<uint64_t>();
+            if (m_end == nullptr) {
+                auto encoded = std::make_shared<std::vector<uint8_t>>(encoded_bytes);
+                read(reinterpret_cast<char*>(encoded->data()), encoded_bytes);
+                span = compressed_span<T>(encoded->data(), encoded_bytes, n, encoded);
+            } else {
+                uint8_t* data = m_end;
+                consume(encoded_bytes);
+                read(reinterpret_cast<char*>(data), encoded_bytes);
+                span = compressed_span<T>(data, encoded_bytes, n);
+            }
         }
 
         uint8_t* end() { return m_end; }
 
         size_t size() const { return m_size; }
 
+        /* Payloads left to read, see io_options. */
+        std::vector<io_request<char*>> const& deferred() const { return m_deferred; }
+
         size_t allocated() const {
             assert(m_end >= m_begin);
             return m_end - m_begin;
@@ -673,27 +4491,91 @@ struct contiguous_memory_allocator {
             m_end += num_bytes;
         }
 
+        /* Skip the bytes needed to place an array of T at its natural alignment. */
+        template <typename T>
+        void align() {
+            if (m_end == nullptr) return;
+            consume(arena_padding<T>(allocated()));
+        }
+
     private:
         uint8_t* m_begin;
         uint8_t* m_end;
         size_t m_size;
-        std::ifstream m_is;
+        size_t m_min_deferred_bytes;
+        bool m_direct;
+        std::vector<io_request<char*>> m_deferred;
+
+        template <typename T>
+        bool deferred(size_t n) const {
+            return m_min_deferred_bytes != 0 && n * sizeof(T) >= m_min_deferred_bytes &&
+                   !compressed<T>() && !m_opts.verify_checksum;
+        }
+
+        /* Place a payload read with O_DIRECT, see io_options. */
+        template <typename T>
+        void place(size_t n) {
+            if (m_end == nullptr || !m_direct || !deferred<T>(n)) return;
+            if (n * sizeof(T) < min_placed_bytes) return;
+            if (m_offset % alignof(T) != 0) return;  // the payload would be misaligned
+            const size_t alignment = direct_io_alignment;
+            consume((m_offset % alignment + alignment - allocated() % alignment) % alignment);
+        }
+
+        /* Read the payload of n values of T, or only record its file offset if it is
+           large enough to be read later with pread(). */
+        template <typename T>
+        void read_or_defer(T* data, size_t n) {
+            size_t num_bytes = n * sizeof(T);
+            if (deferred<T>(n)) {
+                m_deferred.push_back({reinterpret_cast<char*>(data), m_offset, num_bytes});
+                m_is.seekg(static_cast<std::streamoff>(num_bytes), std::ios::cur);
+                m_offset += num_bytes;
+            } else {
+                read_payload(data, n);
+            }
+        }
     };
 
+    /* Load the data structure with one read of the file when its header records the
+       arena size, otherwise after a prescan that seeks over the payloads. */
     template <typename T>
-    size_t allocate(T& data_structure, char const* filename) {
-        loader l(filename);
-        l.visit(data_structure);
-        m_size = l.bytes_vecs_of_pods();
-        m_begin = reinterpret_cast<uint8_t*>(malloc(m_size));
-        if (m_begin == nullptr) throw std::runtime_error("malloc failed");
-        visitor v(m_begin, m_size, filename);
+    size_t allocate(T& data_structure, char const* filename, format_options const& opts = {},
+                    arena_options const& arena = {}, io_options const& io = {}) {
+        {
+            prescan p(filename, opts);
+            if (opts.header) p.check_layout(layout_hash(data_structure));
+            if (p.has_arena_bytes()) {
+                m_size = p.header_arena_bytes();
+            } else {
+                p.visit(data_structure);
+                m_size = p.arena_bytes();
+            }
+        }
+        bool direct = io.num_threads != 0 && io.direct;
+        if (direct && m_size != 0) {
+            m_size += (m_size / min_placed_bytes + 1) * direct_io_alignment;  // see io_options
+        }
+        allocate_arena(arena, direct ? direct_io_alignment : 64);
+        visitor v(m_begin, m_size, filename, opts, io);
         v.visit(data_structure);
+        if (!v.deferred().empty()) {
+            pread_file file(filename, io.direct);
+            file.read(v.deferred(), io.num_threads);
+            m_direct_io = file.direct();
+        }
+        v.check_checksum();
         m_end = v.end();
-        return l.bytes();
+        return v.bytes();
     }
 
-    ~contiguous_memory_allocator() { free(m_begin); }
+    ~contiguous_memory_allocator() {
+        if (m_mapped_bytes != 0) {
+            ::munmap(m_begin, m_mapped_bytes);
+        } else {
+            free(m_begin);
+        }
+    }
 
     uint8_t* begin() { return m_begin; }
 
@@ -701,75 +4583,404 @@ struct contiguous_memory_allocator {
 
     size_t size() const { return m_size; }
 
+    /* Whether the arena is backed by explicitly reserved huge pages (MAP_HUGETLB). */
+    bool huge_pages() const { return m_huge_pages; }
+
+    /* Whether the arena was successfully bound to the requested NUMA node. */
+    bool numa_bound() const { return m_numa_bound; }
+
+    /* Whether arrays were read with O_DIRECT, see io_options. */
+    bool direct_io() const { return m_direct_io; }
+
 private:
     uint8_t* m_begin;
     uint8_t* m_end;
     size_t m_size;
+    size_t m_mapped_bytes;  // non-zero if the arena is mmapped rather than malloc'ed
+    bool m_huge_pages;
+    bool m_numa_bound;
+    bool m_direct_io;
+
+    void allocate_arena(arena_options const& arena, size_t alignment) {
+        if (m_size == 0) return;
+        if (!arena.huge_pages && arena.numa_node < 0) {
+            m_begin = reinterpret_cast<uint8_t*>(
+                std::aligned_alloc(alignment, (m_size + alignment - 1) / alignment * alignment));
+            if (m_begin == nullptr) throw std::runtime_error("malloc failed");
+            return;
+        }
+
+        static const size_t huge_page_bytes = 2 * MiB;
+        size_t page_bytes = arena.huge_pages ? huge_page_bytes : sysconf(_SC_PAGESIZE);
+        m_mapped_bytes = (m_size + page_bytes - 1) / page_bytes * page_bytes;
+        void* addr = MAP_FAILED;
+        int prot = PROT_READ | PROT_WRITE;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_HUGETLB
+        if (arena.huge_pages) {
+            addr = ::mmap(nullptr, m_mapped_bytes, prot, flags | MAP_HUGETLB, -1, 0);
+            m_huge_pages = addr != MAP_FAILED;
+        }
+#endif
+        if (addr == MAP_FAILED && arena.huge_pages) {
+            /* over-allocate and trim, so that the arena starts at a huge page boundary */
+            size_t bytes = m_mapped_bytes + huge_page_bytes;
+            addr = ::mmap(nullptr, bytes, prot, flags, -1, 0);
+            if (addr == MAP_FAILED) throw std::runtime_error("mmap failed");
+            uintptr_t p = reinterpret_cast<uintptr_t>(addr);
+            uintptr_t aligned = (p + huge_page_bytes - 1) / huge_page_bytes * huge_page_bytes;
+            if (aligned != p) ::munmap(addr, aligned - p);
+            ::munmap(reinterpret_cast<void*>(aligned + m_mapped_bytes),
+                     (p + bytes) - (aligned + m_mapped_bytes));
+            addr = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+            ::madvise(addr, m_mapped_bytes, MADV_HUGEPAGE);
+#endif
+        } else if (addr == MAP_FAILED) {
+            addr = ::mmap(nullptr, m_mapped_bytes, prot, flags, -1, 0);
+            if (addr == MAP_FAILED) throw std::runtime_error("mmap failed");
+        }
+        m_begin = static_cast<uint8_t*>(addr);
+
+#ifdef SYS_mbind
+        if (arena.numa_node >= 0) {
+            /* bind before the first touch, so that pages are allocated on the node */
+            static const int mpol_bind = 2;
+            static const size_t bits = sizeof(unsigned long) * 8;
+            std::vector<unsigned long> node_mask(arena.numa_node / bits + 1, 0);
+            node_mask[arena.numa_node / bits] = 1UL << (arena.numa_node % bits);
+            m_numa_bound = syscall(SYS_mbind, addr, m_mapped_bytes, mpol_bind, node_mask.data(),
+                                   node_mask.size() * bits + 1, 0) == 0;
+        }
+#endif
+    }
+};
+
+/*
+    Options for memory-mapping a file.
+
+    populate: prefault the whole file when mapping it (MAP_POPULATE), trading startup
+    latency for no page faults afterwards.
+    will_need: start asynchronous readahead of the whole file (MADV_WILLNEED).
+    advice: expected access pattern, one of MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL.
+    huge_pages: ask for transparent huge pages (MADV_HUGEPAGE), if the file system supports them.
+    warm_up: touch every page from a background thread, so that the mapping becomes
+    resident while the caller is already serving queries.
+*/
+struct mmap_options {
+    bool populate = false;
+    bool will_need = false;
+    int advice = MADV_NORMAL;
+    bool huge_pages = false;
+    bool warm_up = false;
+};
+
+/* The page-aligned range [first, first + second) covering [addr, addr + num_bytes). */
+[[maybe_unused]] static std::pair<void*, size_t> page_range(void const* addr, size_t num_bytes) {
+    uintptr_t page_bytes = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(addr) / page_bytes * page_bytes;
+    uintptr_t end = reinterpret_cast<uintptr_t>(addr) + num_bytes;
+    if (num_bytes == 0) return {nullptr, 0};
+    return {reinterpret_cast<void*>(begin), end - begin};
+}
+
+/* Number of pages covering [addr, addr + num_bytes) and how many are resident in memory. */
+[[maybe_unused]] static std::pair<size_t, size_t> resident_pages(void const* addr,
+                                                                 size_t num_bytes) {
+    auto range = page_range(addr, num_bytes);
+    size_t page_bytes = sysconf(_SC_PAGESIZE);
+    size_t num_pages = (range.second + page_bytes - 1) / page_bytes;
+#ifdef __APPLE__
+    std::vector<char> status(num_pages);
+#else
+    std::vector<unsigned char> status(num_pages);
+#endif
+    if (num_pages == 0 || ::mincore(range.first, range.second, status.data()) != 0) {
+        return {num_pages, 0};
+    }
+    size_t resident = 0;
+    for (auto s : status) resident += s & 1;
+    return {num_pages, resident};
+}
+
+/*
+    A read-only memory mapping of a whole file, unmapped on destruction.
+    It is the owner shared by all the owning_spans returned by mmap().
+*/
+struct mapped_region {
+    mapped_region(char const* filename, mmap_options const& opts = {})
+        : m_data(nullptr)
+        , m_size(0)
+        , m_stop(false)
+        , m_warmed_up(false) {
+        int fd = ::open(filename, O_RDONLY);
+        if (fd == -1) throw std::runtime_error("Failed to open file for mmap");
+        struct stat sb;
+        if (fstat(fd, &sb) == -1) {
+            close(fd);
+            throw std::runtime_error("fstat failed");
+        }
+        m_size = sb.st_size;
+        int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        if (opts.populate) flags |= MAP_POPULATE;
+#endif
+        void* addr = ::mmap(nullptr, m_size, PROT_READ, flags, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) throw std::runtime_error("mmap failed");
+        m_data = static_cast<uint8_t const*>(addr);
+
+        if (opts.advice != MADV_NORMAL) advise(m_data, m_size, opts.advice);
+        if (opts.will_need) advise(m_data, m_size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+        if (opts.huge_pages) advise(m_data, m_size, MADV_HUGEPAGE);
+#endif
+        if (opts.warm_up) warm_up();
+    }
+
+    mapped_region(mapped_region const&) = delete;
+    mapped_region& operator=(mapped_region const&) = delete;
+
+    ~mapped_region() {
+        m_stop = true;
+        if (m_warm_up_thread.joinable()) m_warm_up_thread.join();
+        ::munmap(const_cast<uint8_t*>(m_data), m_size);
+    }
+
+    uint8_t const* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    /* Apply madvise() to the pages overlapping [addr, addr + num_bytes).
+       Return false if the range is outside the region or madvise() fails. */
+    bool advise(void const* addr, size_t num_bytes, int advice) const {
+        auto range = pages(addr, num_bytes);
+        if (range.second == 0) return false;
+        return ::madvise(range.first, range.second, advice) == 0;
+    }
+
+    /* Touch every page from a background thread. Does nothing if already started. */
+    void warm_up() {
+        if (m_warm_up_thread.joinable() || m_warmed_up) return;
+        m_warm_up_thread = std::thread([this]() {
+            size_t page_bytes = sysconf(_SC_PAGESIZE);
+            uint8_t sum = 0;
+            for (size_t i = 0; i < m_size && !m_stop; i += page_bytes) {
+                sum += *static_cast<uint8_t const volatile*>(m_data + i);
+            }
+            do_not_optimize_away(sum);
+            m_warmed_up = !m_stop;
+        });
+    }
+
+    /* Whether the background warm-up has touched every page. */
+    bool warmed_up() const { return m_warmed_up; }
+
+    /* Lock the pages overlapping [addr, addr + num_bytes) in memory with mlock(), so that
+       they are never evicted. Return false if the range is outside the region or mlock()
+       fails, e.g., because RLIMIT_MEMLOCK is too low. */
+    bool lock(void const* addr, size_t num_bytes) const {
+        auto range = pages(addr, num_bytes);
+        if (range.second == 0) return false;
+        return ::mlock(range.first, range.second) == 0;
+    }
+    bool lock() const { return lock(m_data, m_size); }
+
+    bool unlock(void const* addr, size_t num_bytes) const {
+        auto range = pages(addr, num_bytes);
+        if (range.second == 0) return false;
+        return ::munlock(range.first, range.second) == 0;
+    }
+    bool unlock() const { return unlock(m_data, m_size); }
+
+    /* Fraction of the pages of the region currently resident in memory (via mincore()). */
+    double resident_fraction() const {
+        auto p = resident_pages(m_data, m_size);
+        return p.first ? static_cast<double>(p.second) / p.first : 0.0;
+    }
+
+    size_t resident_bytes() const {
+        return std::min<size_t>(resident_pages(m_data, m_size).second * sysconf(_SC_PAGESIZE),
+                                m_size);
+    }
+
+    /* Add the mapped and resident sizes to the current line of jl. */
+    template <typename JsonLines>
+    void add_to(JsonLines& jl, std::string const& prefix = "mmap_") const {
+        auto p = resident_pages(m_data, m_size);
+        jl.add(prefix + "bytes", m_size);
+        jl.add(prefix + "pages", p.first);
+        jl.add(prefix + "resident_pages", p.second);
+        jl.add(prefix + "resident_fraction",
+               p.first ? static_cast<double>(p.second) / p.first : 0.0);
+    }
+
+protected:
+    uint8_t const* m_data;
+    size_t m_size;
+
+    /* The page-aligned range overlapping [addr, addr + num_bytes), clipped to the region.
+       Its size is 0 if the range does not overlap the region. */
+    std::pair<void*, size_t> pages(void const* addr, size_t num_bytes) const {
+        uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+        uintptr_t end = begin + num_bytes;
+        uintptr_t region_begin = reinterpret_cast<uintptr_t>(m_data);
+        begin = std::max(begin, region_begin);
+        end = std::min(end, region_begin + m_size);
+        if (end <= begin) return {nullptr, 0};
+        return page_range(reinterpret_cast<void const*>(begin), end - begin);
+    }
+
+private:
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_warmed_up;
+    std::thread m_warm_up_thread;
 };
 
-template <typename Visitor, typename T>
-static size_t visit(T&& data_structure, char const* filename) {
-    Visitor visitor(filename);
+/* Apply madvise() to the pages of a span obtained from mmap(), e.g., MADV_WILLNEED
+   to prefetch it or MADV_RANDOM to disable readahead for it. */
+template <typename T>
+static bool advise(owning_span<T> const& span, int advice) {
+    if (span.empty()) return false;
+    auto range = page_range(span.data(), span.size() * sizeof(T));
+    return ::madvise(range.first, range.second, advice) == 0;
+}
+
+/* Lock (or unlock) the pages of a span in memory. Pages shared with neighbouring data
+   are locked too, and unlocking them unlocks those neighbours as well. */
+template <typename T>
+static bool lock(owning_span<T> const& span) {
+    if (span.empty()) return false;
+    auto range = page_range(span.data(), span.size() * sizeof(T));
+    return ::mlock(range.first, range.second) == 0;
+}
+
+template <typename T>
+static bool unlock(owning_span<T> const& span) {
+    if (span.empty()) return false;
+    auto range = page_range(span.data(), span.size() * sizeof(T));
+    return ::munlock(range.first, range.second) == 0;
+}
+
+/* Fraction of the pages of a span currently resident in memory. */
+template <typename T>
+static double resident_fraction(owning_span<T> const& span) {
+    auto p = resident_pages(span.data(), span.size() * sizeof(T));
+    return p.first ? static_cast<double>(p.second) / p.first : 0.0;
+}
+
+template <typename Visitor, typename T, typename... Args>
+static size_t visit(T&& data_structure, char const* filename, Args&&... args) {
+    Visitor visitor(filename, std::forward<Args>(args)...);
     visitor.visit(data_structure);
     return visitor.bytes();
 }
 
 template <typename T>
-static size_t load(T& data_structure, char const* filename) {
-    return visit<loader>(data_structure, filename);
+static size_t load(T& data_structure, char const* filename, format_options const& opts = {}) {
+    loader l(filename, opts);
+    if (opts.header) l.check_layout(layout_hash(data_structure));
+    l.visit(data_structure);
+    l.check_checksum();
+    return l.bytes();
 }
 
 template <typename T>
-static size_t load_with_custom_memory_allocation(T& data_structure, char const* filename) {
-    return data_structure.get_allocator().allocate(data_structure, filename);
+static size_t parallel_load(T& data_structure, char const* filename,
+                            size_t num_threads = std::thread::hardware_concurrency(),
+                            format_options const& opts = {}, bool direct_io = false) {
+    parallel_loader l(filename, num_threads, opts, 4 * MiB, direct_io);
+    if (opts.header) l.check_layout(layout_hash(data_structure));
+    l.visit(data_structure);
+    l.read_deferred();
+    l.check_checksum();
+    return l.bytes();
 }
 
 template <typename T>
-static size_t mmap(T& data_structure, char const* filename) {
-    int fd = open(filename, O_RDONLY);
-    if (fd == -1) {
-        std::cerr << "Failed to open file for mmap\n";
-        return 0;
-    }
+static size_t load_with_custom_memory_allocation(
+    T& data_structure, char const* filename, format_options const& opts = {},
+    contiguous_memory_allocator::arena_options const& arena = {},
+    contiguous_memory_allocator::io_options const& io = {}) {
+    return data_structure.get_allocator().allocate(data_structure, filename, opts, arena, io);
+}
 
-    size_t file_size = 0;
-    {
-        struct stat sb;
-        fstat(fd, &sb);
-        file_size = sb.st_size;
-    }
+template <typename T>
+static size_t mmap(T& data_structure, std::shared_ptr<mapped_region> const& region,
+                   format_options const& opts = {}) {
+    // The region owns the mapping: every owning_span pointing into it shares its
+    // ownership, so munmap is called automatically when the last one dies.
+    std::shared_ptr<const void> mmap_owner(region, region->data());
+    mmap_loader l(region->data(), region->size(), mmap_owner, opts);
+    if (opts.header) l.check_layout(layout_hash(data_structure));
+    l.check_checksum();
+    l.visit(data_structure);
+    return l.bytes();
+}
 
-    uint8_t const* mmap_base =
-        static_cast<uint8_t const*>(::mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0));
-    if (mmap_base == MAP_FAILED) {
-        std::cerr << "mmap failed\n";
-        close(fd);
+template <typename T>
+static size_t mmap(T& data_structure, char const* filename, format_options const& opts = {},
+                   mmap_options const& mopts = {}) {
+    std::shared_ptr<mapped_region> region;
+    try {
+        region = std::make_shared<mapped_region>(filename, mopts);
+    } catch (std::runtime_error const& e) {
+        std::cerr << e.what() << "\n";
         return 0;
     }
-    close(fd);
-
-    // Create the "owner" shared_ptr with a custom deleter.
-    // This ensures munmap is called automatically when the last owning_span dies.
-    std::shared_ptr<const void> mmap_owner(mmap_base, [file_size](void const* p) {
-        // std::cout << "[Deleter] Unmapping " << file_size << " bytes from " << p << "\n";
-        ::munmap(const_cast<void*>(p), file_size);
-    });
+    return mmap(data_structure, region, opts);
+}
 
-    loader l(filename);
-    l.set_mmap(mmap_base, file_size, mmap_owner);
+/* Visit the file with a streaming_loader, passing the arrays to f in chunks. */
+template <typename T, typename F>
+static size_t stream(T& data_structure, char const* filename, F f, format_options const& opts = {},
+                     size_t chunk_bytes = 4 * MiB) {
+    streaming_loader<F> l(filename, std::move(f), opts, chunk_bytes);
+    if (opts.header) l.check_layout(layout_hash(data_structure));
     l.visit(data_structure);
-
+    l.check_checksum();
     return l.bytes();
 }
 
 template <typename T>
-static size_t save(T const& data_structure, char const* filename) {
-    return visit<saver>(data_structure, filename);
+static size_t save(T const& data_structure, char const* filename, format_options const& opts = {}) {
+    saver s(filename, opts);
+    s.visit(data_structure);
+    s.write_header(opts.header ? layout_hash(data_structure) : 0);
+    return s.bytes();
+}
+
+template <typename T>
+static size_t parallel_save(T const& data_structure, char const* filename,
+                            size_t num_threads = std::thread::hardware_concurrency(),
+                            format_options const& opts = {}) {
+    parallel_saver s(filename, num_threads, opts);
+    s.visit(data_structure);
+    s.write_header(opts.header ? layout_hash(data_structure) : 0);
+    s.write_deferred();
+    return s.bytes();
+}
+
+/*
+    Serialize data_structure into the buffers of an async_saver and return it while the
+    buffers are still being written: data_structure may be modified or freed right away,
+    and wait() on the returned saver gives the number of bytes once the file is in place.
+*/
+template <typename T>
+static std::unique_ptr<async_saver> async_save(T const& data_structure, char const* filename,
+                                               format_options const& opts = {},
+                                               async_save_options const& async = {}) {
+    auto s = std::make_unique<async_saver>(filename, opts, async);
+    s->visit(data_structure);
+    s->write_header(opts.header ? layout_hash(data_structure) : 0);
+    s->close();
+    return s;
 }
 
 template <typename T, typename Device>
-static size_t print_size(T& data_structure, Device& device) {
-    sizer visitor(demangle(typeid(T).name()));
+static size_t print_size(T& data_structure, Device& device, format_options const& opts = {},
+                         bool aggregate = false) {
+    sizer visitor(demangle(typeid(T).name()), opts, aggregate);
     visitor.visit(data_structure);
     visitor.print(device);
     return visitor.bytes();
@@ -1,6 +1,12 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <sstream>
+#include <fstream>
+#include <numeric>
+#include <iterator>
+#include <cmath>
+#include <thread>
 #include <cassert>
 #include <cstdio>
 #include <stdexcept>
@@ -85,12 +91,354 @@ void test_advanced_timer() {
     assert(t.runs() == 3);
 
     assert(t.average() > 0.0);
+    assert(t.min() <= t.median() && t.median() <= t.max());
+    assert(t.percentile(0) == t.min() && t.percentile(100) == t.max());
 
     t.reset();
     assert(t.runs() == 0);
     assert(t.elapsed() == 0.0);
 }
 
+/* A clock advanced by hand, so that benchmarks can be tested deterministically. */
+struct manual_clock {
+    typedef std::chrono::nanoseconds duration;
+    typedef duration::rep rep;
+    typedef duration::period period;
+    typedef std::chrono::time_point<manual_clock> time_point;
+    static constexpr bool is_steady = true;
+
+    static time_point now() { return time_point(duration(elapsed)); }
+    static void advance(double seconds) { elapsed += static_cast<rep>(seconds * 1e9); }
+    static double seconds() { return elapsed / 1e9; }
+
+    static inline rep elapsed = 0;
+};
+
+void test_timer_statistics() {
+    essentials::statistics empty;
+    assert(empty.runs == 0);
+
+    essentials::timer_type idle;
+    assert(idle.min() == 0.0 && idle.max() == 0.0 && idle.median() == 0.0);
+
+    essentials::statistics st(std::vector<double>{5, 1, 4, 2, 3});
+    assert(st.runs == 5);
+    assert(st.min == 1 && st.max == 5 && st.median == 3 && st.mean == 3);
+    assert(std::abs(st.stddev - std::sqrt(2.5)) < 1e-9);
+    assert(st.p90 > 4 && st.p90 < 5);
+    assert(st.ci95_low < st.mean && st.mean < st.ci95_high);
+
+    essentials::benchmark_options opts;
+    opts.max_seconds = 0.5;
+    opts.min_sample_seconds = 0.0005;
+    essentials::benchmark<std::chrono::steady_clock, std::chrono::nanoseconds> b(opts);
+    uint64_t x = 0;
+    auto const& stats = b.run([&]() { essentials::do_not_optimize_away(x += 3); });
+    assert(b.iterations() > 1);
+    assert(stats.runs >= opts.min_runs);
+    assert(stats.min <= stats.median && stats.median <= stats.p99 && stats.p99 <= stats.max);
+
+    essentials::json_lines jl;
+    b.add_to(jl, "add_");
+
+    {
+        // a call just below min_sample_seconds still gets more iterations per run
+        manual_clock::elapsed = 0;
+        opts.min_sample_seconds = 0.01;
+        opts.max_seconds = 1;
+        essentials::benchmark<manual_clock, std::chrono::nanoseconds> slow(opts);
+        auto const& slow_stats = slow.run([]() { manual_clock::advance(0.009); });
+        assert(slow.iterations() == 2);
+        assert(slow_stats.runs >= opts.min_runs && slow_stats.mean == 9e6);
+        (void)slow_stats;
+    }
+
+    {
+        // max_seconds bounds calibration and warm-up as well, and one run is measured
+        for (double call_seconds : {0.009, 0.0001}) {
+            manual_clock::elapsed = 0;
+            opts.min_sample_seconds = 1;
+            opts.max_seconds = 0.05;
+            essentials::benchmark<manual_clock, std::chrono::nanoseconds> bounded(opts);
+            auto const& bounded_stats =
+                bounded.run([=]() { manual_clock::advance(call_seconds); });
+            assert(bounded_stats.runs >= 1);
+            assert(manual_clock::seconds() < 2 * opts.max_seconds);
+            (void)bounded_stats;
+        }
+    }
+    (void)stats;
+}
+
+void test_perf_timer() {
+    essentials::perf_timer_type t;
+    uint64_t x = 0;
+    for (int run = 0; run != 3; ++run) {
+        t.start();
+        for (int i = 0; i != 1000000; ++i) essentials::do_not_optimize_away(x += i);
+        t.stop();
+    }
+    assert(t.runs() == 3 && t.wall_clock().runs() == 3);
+    for (size_t i = 0; i != essentials::perf_counters::num_events; ++i) {
+        // unavailable counters (e.g., in containers) read as 0
+        if (!t.available(i)) assert(t.total(i) == 0.0);
+    }
+    if (t.available(1)) assert(t.average(1) >= 1000000);
+
+    essentials::json_lines jl;
+    t.add_to(jl);
+
+    {
+        // unavailable counters are left out rather than written as strings
+        const char* file = "test_perf_timer.json";
+        {
+            essentials::json_lines_writer w(file);
+            t.add_to(w);
+        }
+        std::ifstream in(file);
+        std::string line;
+        std::getline(in, line);
+        assert(line.find("null") == std::string::npos);
+        for (size_t i = 0; i != essentials::perf_counters::num_events; ++i) {
+            bool found = line.find(essentials::perf_counters::name(i)) != std::string::npos;
+            assert(found == t.available(i));
+            (void)found;
+        }
+        std::remove(file);
+    }
+
+    t.reset();
+    assert(t.runs() == 0);
+}
+
+// tsc_clock may be used by static initializers: it calibrates itself on first use
+static const double static_nanoseconds_per_tick = essentials::tsc_clock::nanoseconds_per_tick();
+
+void test_tsc_timer() {
+    assert(static_nanoseconds_per_tick > 0.0);
+    assert(static_nanoseconds_per_tick == essentials::tsc_clock::nanoseconds_per_tick());
+
+    {
+        // the first timed interval does not include the calibration
+        essentials::tsc_timer_type first;
+        first.start();
+        first.stop();
+        assert(first.max() < 1e6);
+    }
+
+    assert(essentials::tsc_clock::nanoseconds_per_tick() > 0.0);
+    auto a = essentials::tsc_clock::now();
+    auto b = essentials::tsc_clock::now();
+    assert(b >= a);
+
+    essentials::tsc_timer_type t;
+    t.calibrate_overhead();
+    assert(t.runs() == 0 && t.overhead() > 0.0);
+
+    uint64_t x = 1;
+    for (int run = 0; run != 100; ++run) {
+        t.start();
+        for (int i = 0; i != 1000; ++i) essentials::do_not_optimize_away(x *= 3);
+        t.stop();
+    }
+    assert(t.runs() == 100 && t.min() >= 0.0);
+    // 1000 dependent multiplications take at least 1000 cycles
+    assert(t.median() > 100.0);
+    (void)a;
+    (void)b;
+}
+
+void test_streaming_timer() {
+    essentials::latency_histogram h1, h2;
+    for (int i = 1; i <= 1000; ++i) h1.record(i);
+    for (int i = 1001; i <= 100000; ++i) h2.record(i);
+    assert(h1.count() == 1000 && h1.min() == 1 && h1.max() == 1000);
+    assert(std::abs(h1.median() - 500) <= 500 / 64.0);
+    h1.merge(h2);
+    assert(h1.count() == 100000 && h1.max() == 100000);
+    assert(h1.mean() == 50000.5);
+    for (double p : {1.0, 50.0, 90.0, 99.0, 99.9}) {
+        double exact = p / 100 * 100000;
+        assert(std::abs(h1.percentile(p) - exact) <= exact / 64.0);
+        (void)exact;
+    }
+    assert(h1.percentile(100) == 100000);
+    h1.record(uint64_t(1) << 62);
+    assert(h1.percentile(100) == double(uint64_t(1) << 62));
+
+    {
+        // NaNs are only counted; huge and negative values land in the end buckets
+        essentials::latency_histogram h;
+        h.record(std::nan(""));
+        assert(h.count() == 0 && h.nan_count() == 1 && h.min() == 0.0 && h.max() == 0.0);
+        h.record(1e30);
+        h.record(-5.0);
+        assert(h.count() == 2 && h.nan_count() == 1);
+        assert(h.min() == -5.0 && h.max() == 1e30);
+        assert(h.percentile(1) == 0.5 && h.percentile(100) == 1e30);
+        assert(h.percentile(99) >= std::ldexp(1.0, 63) && h.percentile(99) < 1e30);
+        essentials::latency_histogram merged;
+        merged.merge(h);
+        assert(merged.count() == 2 && merged.nan_count() == 1);
+        (void)h;
+    }
+
+    essentials::streaming_timer_type t1, t2;
+    for (int run = 0; run != 5; ++run) {
+        t1.start();
+        t1.stop();
+        t2.start();
+        t2.stop();
+    }
+    t1.merge(t2);
+    assert(t1.runs() == 10 && t1.min() <= t1.median() && t1.median() <= t1.max());
+    t1.reset();
+    assert(t1.runs() == 0);
+    (void)h1;
+}
+
+void test_latency_recorder() {
+    const size_t num_threads = 4;
+    const size_t ops = 10000;
+    essentials::latency_recorder<> recorder(num_threads);
+    recorder.begin();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t != num_threads; ++t) {
+        threads.emplace_back([&recorder, t]() {
+            auto& shard = recorder.local(t);
+            uint64_t x = t;
+            for (size_t i = 0; i != ops; ++i) {
+                shard.start();
+                essentials::do_not_optimize_away(x += i);
+                shard.stop();
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    recorder.end();
+
+    assert(reinterpret_cast<uintptr_t>(&recorder.local(1)) % 64 == 0);
+    assert(recorder.local(2).histogram().count() == ops);
+    assert(recorder.merged().count() == num_threads * ops);
+    assert(recorder.throughput() > 0.0);
+    essentials::json_lines jl;
+    recorder.add_to(jl);
+}
+
+void test_json_lines_writer() {
+    char const* filename = "./json_lines_writer.jsonl";
+    {
+        // a tiny buffer forces several incremental flushes
+        essentials::json_lines_writer jl(filename, 16);
+        for (int i = 0; i != 3; ++i) {
+            jl.new_line();
+            jl.add("query", i);
+            jl.add("time", 0.5 + i);
+        }
+        jl.new_line();
+        jl.add("name", "a \"quoted\"\tname");
+        jl.add("ok", true);
+        jl.add("nan", std::nan(""));
+        jl.add("bytes", std::string("x"));
+        essentials::statistics stats;
+        stats.runs = 1;
+        stats.add_to(jl, "s_");
+    }
+    std::ifstream in(filename);
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(in, line);) lines.push_back(line);
+    in.close();
+    std::remove(filename);
+    assert(lines.size() == 4);
+    assert(lines[0] == "{\"query\": 0, \"time\": 0.5}");
+    assert(lines[2] == "{\"query\": 2, \"time\": 2.5}");
+    assert(lines[3].find("{\"name\": \"a \\\"quoted\\\"\\u0009name\", \"ok\": true, "
+                         "\"nan\": null, \"bytes\": \"x\", \"s_runs\": 1, ") == 0);
+    (void)lines;
+}
+
+void test_async_logger() {
+    char const* filename = "./async_logger.log";
+    int fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    {
+        essentials::async_logger log(fd, 64);
+        log.log(essentials::log_level::info, "hello");
+        log.log(essentials::log_level::debug, "hidden");
+        log.log(essentials::log_level::error, std::string(1000, 'x'));
+        // the ring holds 64 messages: producers wait for free slots
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t != 4; ++t) {
+            threads.emplace_back([&log]() {
+                for (size_t i = 0; i != 100; ++i) log.log(essentials::log_level::info, "worker");
+            });
+        }
+        for (auto& t : threads) t.join();
+        log.flush();
+        assert(log.dropped() == 0);
+        log.set_rate_limit(10);
+        for (size_t i = 0; i != 100; ++i) log.log(essentials::log_level::warning, "limited");
+        assert(log.dropped() >= 80);
+        log.set_rate_limit(0);
+        log.set_blocking(false);
+        for (size_t i = 0; i != 1000; ++i) log.log(essentials::log_level::info, "burst");
+    }
+    ::close(fd);
+
+    std::ifstream in(filename);
+    size_t hello = 0, hidden = 0, spilled = 0, workers = 0, limited = 0, bursts = 0, reports = 0;
+    for (std::string line; std::getline(in, line);) {
+        // timestamp "YYYY-MM-DD HH:MM:SS: " then the message
+        assert(line.size() > 21 && line[4] == '-' && line.substr(19, 2) == ": ");
+        std::string msg = line.substr(21);
+        hello += msg == "hello";
+        hidden += msg == "hidden";
+        spilled += msg == "[error] " + std::string(1000, 'x');
+        workers += msg == "worker";
+        limited += msg == "[warning] limited";
+        bursts += msg == "burst";
+        reports += msg.find("[logger] ") == 0;
+    }
+    in.close();
+    std::remove(filename);
+    assert(hello == 1 && hidden == 0 && spilled == 1 && workers == 400);
+    assert(limited <= 20 && bursts > 0 && reports >= 1);
+    (void)hello, (void)hidden, (void)spilled, (void)workers, (void)limited, (void)bursts;
+    (void)reports;
+
+    {
+        std::stringstream ss;
+        {
+            essentials::async_logger log(ss, 2);
+            for (size_t i = 0; i != 10; ++i) log.log(essentials::log_level::info, "line");
+            log.flush();
+            size_t lines = std::count(std::istreambuf_iterator<char>(ss.rdbuf()),
+                                      std::istreambuf_iterator<char>(), '\n');
+            assert(lines == 10);
+            (void)lines;
+        }
+    }
+
+    {
+        // flush() before writing to the same stream keeps the lines in order
+        std::stringstream ss;
+        essentials::async_logger log(ss);
+        for (size_t i = 0; i != 100; ++i) {
+            log.log(essentials::log_level::info, "log " + std::to_string(i));
+            log.flush();
+            ss << "own " << i << '\n';
+        }
+        size_t i = 0;
+        for (std::string line; std::getline(ss, line); ++i) {
+            std::string expected = (i % 2 ? "own " : "log ") + std::to_string(i / 2);
+            assert(line.size() >= expected.size() &&
+                   line.compare(line.size() - expected.size(), expected.size(), expected) == 0);
+            (void)expected;
+        }
+        assert(i == 200);
+    }
+}
+
 void test_owning_span_models() {
     // Model 1: Heap-Owned (Rvalue / Moved)
     {
@@ -165,6 +513,1216 @@ void test_serialization_edge_cases() {
     std::remove(file);
 }
 
+struct MappedStruct {
+    uint32_t id;
+    std::vector<uint16_t> small;
+    essentials::owning_span<uint64_t> payload;
+    std::vector<std::vector<int>> nested;
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) {
+        visitor.visit(id);
+        visitor.visit(small);
+        visitor.visit(payload);
+        visitor.visit(nested);
+    }
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) const {
+        visitor.visit(id);
+        visitor.visit(small);
+        visitor.visit(payload);
+        visitor.visit(nested);
+    }
+};
+
+void test_mmap_loader() {
+    const char* file = "test_mmap_loader.bin";
+
+    size_t written = 0;
+    {
+        MappedStruct s;
+        s.id = 7;
+        s.small = {1, 2, 3};
+        s.payload = std::vector<uint64_t>{10, 20, 30, 40};
+        s.nested = {{1}, {}, {2, 3}};
+        written = essentials::save(s, file);
+    }
+
+    {
+        MappedStruct s;
+        size_t mapped = essentials::mmap(s, file);
+        assert(mapped == written);
+        assert(s.id == 7);
+        assert(s.small.size() == 3 && s.small[2] == 3);
+        assert(s.payload.size() == 4 && s.payload[3] == 40);
+        assert(s.nested.size() == 3 && s.nested[1].empty() && s.nested[2][1] == 3);
+        (void)mapped;
+    }
+
+    // A truncated file must be rejected rather than read out of bounds.
+    if (truncate(file, static_cast<off_t>(written - 4)) == 0) {
+        MappedStruct s;
+        ASSERT_THROWS(essentials::mmap(s, file), std::runtime_error);
+    }
+
+    {
+        // A corrupt size whose byte count overflows must be rejected before allocating.
+        MappedStruct s;
+        s.small = {1, 2};
+        essentials::save(s, file);
+        uint64_t n = (uint64_t(1) << 63) + 2;  // n * sizeof(uint16_t) wraps around to 4
+        std::fstream f(file, std::ios::binary | std::ios::in | std::ios::out);
+        f.seekp(sizeof(s.id));
+        f.write(reinterpret_cast<char const*>(&n), sizeof(n));
+        f.close();
+        ASSERT_THROWS(essentials::mmap(s, file), std::runtime_error);
+    }
+
+    std::remove(file);
+}
+
+void test_aligned_format() {
+    const char* file = "test_aligned_format.bin";
+
+    essentials::format_options opts;
+    opts.alignment = 64;
+
+    MappedStruct original;
+    original.id = 3;
+    original.small = {4, 5};
+    original.payload = std::vector<uint64_t>{6, 7, 8};
+    original.nested = {{9, 10}};
+
+    size_t written = essentials::save(original, file, opts);
+    std::stringstream ss;
+    assert(essentials::print_size(original, ss, opts) == written);
+
+    {
+        MappedStruct s;
+        assert(essentials::load(s, file, opts) == written);
+        assert(s.small[1] == 5 && s.payload[2] == 8 && s.nested[0][1] == 10);
+    }
+
+    {
+        MappedStruct s;
+        assert(essentials::mmap(s, file, opts) == written);
+        assert(reinterpret_cast<uintptr_t>(s.payload.data()) % 64 == 0);
+        assert(s.id == 3 && s.payload[0] == 6 && s.payload[2] == 8);
+    }
+
+    opts.alignment = 3;
+    (void)written;
+    ASSERT_THROWS(essentials::save(original, file, opts), std::runtime_error);
+
+    std::remove(file);
+}
+
+// Only loadable: like many existing types, it has no const visit().
+struct LoadOnlyStruct {
+    uint32_t id;
+    std::vector<uint64_t> values;
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) {
+        visitor.visit(id);
+        visitor.visit(values);
+    }
+};
+
+void test_file_header() {
+    const char* file = "test_file_header.bin";
+
+    assert(essentials::crc32c("123456789", 9) == 0xE3069283);
+    assert(essentials::crc32c("6789", 4, essentials::crc32c("12345", 5)) == 0xE3069283);
+
+    essentials::format_options opts;
+    opts.alignment = 8;
+    opts.header = true;
+    opts.verify_checksum = true;
+
+    MappedStruct original;
+    original.id = 11;
+    original.payload = std::vector<uint64_t>{1, 2, 3};
+    original.nested = {{4}, {5, 6}};
+
+    size_t written = essentials::save(original, file, opts);
+    assert(written == essentials::file_size(file));
+    std::stringstream ss;
+    assert(essentials::print_size(original, ss, opts) == written);
+
+    {
+        // alignment is read from the header
+        essentials::format_options read_opts;
+        read_opts.header = true;
+        read_opts.verify_checksum = true;
+        MappedStruct s;
+        assert(essentials::load(s, file, read_opts) == written);
+        assert(s.id == 11 && s.payload[2] == 3 && s.nested[1][1] == 6);
+        MappedStruct m;
+        assert(essentials::mmap(m, file, read_opts) == written);
+        assert(reinterpret_cast<uintptr_t>(m.payload.data()) % 8 == 0);
+        assert(m.payload[1] == 2);
+    }
+
+    {
+        // a different type is rejected
+        PodStruct p;
+        ASSERT_THROWS(essentials::load(p, file, opts), std::runtime_error);
+        // a file without header is rejected
+        essentials::format_options no_header;
+        essentials::save(original, file, no_header);
+        MappedStruct s;
+        ASSERT_THROWS(essentials::load(s, file, opts), std::runtime_error);
+    }
+
+    {
+        // a flipped payload byte is detected only when verifying the checksum
+        essentials::save(original, file, opts);
+        std::fstream f(file, std::ios::binary | std::ios::in | std::ios::out);
+        f.seekp(static_cast<std::streamoff>(written - 1));
+        f.put(char(0x7F));
+        f.close();
+        MappedStruct s;
+        ASSERT_THROWS(essentials::load(s, file, opts), std::runtime_error);
+        ASSERT_THROWS(essentials::mmap(s, file, opts), std::runtime_error);
+        opts.verify_checksum = false;
+        essentials::load(s, file, opts);
+    }
+
+    {
+        // a type with only a non-const visit() loads with and without a header
+        LoadOnlyStruct l;
+        uint32_t id = 3;
+        std::vector<uint64_t> values = {7, 8, 9};
+        for (bool header : {false, true}) {
+            essentials::format_options o;
+            o.header = header;
+            size_t bytes = 0;
+            {
+                essentials::saver s(file, o);
+                s.visit(id);
+                s.visit(values);
+                s.write_header(essentials::layout_hash(l));
+                bytes = s.bytes();
+            }
+            LoadOnlyStruct loaded;
+            assert(essentials::load(loaded, file, o) == bytes);
+            (void)bytes;
+            assert(loaded.id == 3 && loaded.values == values);
+        }
+    }
+
+    (void)written;
+    std::remove(file);
+}
+
+void test_parallel_load() {
+    const char* file = "test_parallel_load.bin";
+
+    MappedStruct original;
+    original.id = 5;
+    original.small = {1, 2, 3};
+    std::vector<uint64_t> payload(1000000);
+    std::iota(payload.begin(), payload.end(), 0);
+    original.payload = std::move(payload);
+    original.nested.resize(100, std::vector<int>(1000, 42));
+
+    essentials::format_options opts;
+    opts.alignment = 64;
+    opts.header = true;
+    size_t written = essentials::save(original, file, opts);
+
+    {
+        MappedStruct s;
+        assert(essentials::parallel_load(s, file, 4, opts) == written);
+        assert(s.payload.size() == 1000000 && s.payload[999999] == 999999);
+    }
+
+    {
+        // defer every payload, nested ones included
+        MappedStruct s;
+        essentials::parallel_loader l(file, 3, opts, 1);
+        l.check_layout(essentials::layout_hash(s));
+        l.visit(s);
+        l.read_deferred();
+        l.check_checksum();
+        assert(l.bytes() == written);
+        assert(s.id == 5 && s.small[2] == 3);
+        assert(std::equal(s.payload.begin(), s.payload.end(), original.payload.begin()));
+        assert(s.nested == original.nested);
+    }
+
+    (void)written;
+    std::remove(file);
+}
+
+void test_parallel_save() {
+    const char* file = "test_parallel_save.bin";
+    const char* reference_file = "test_parallel_save_reference.bin";
+
+    MappedStruct original;
+    original.id = 9;
+    std::vector<uint64_t> payload(1000000);
+    std::iota(payload.begin(), payload.end(), 13);
+    original.payload = std::move(payload);
+    original.nested.resize(10, std::vector<int>(100, 7));
+
+    essentials::format_options opts;
+    opts.header = true;
+    opts.alignment = 8;
+
+    size_t reference_bytes = essentials::save(original, reference_file, opts);
+    size_t written = essentials::parallel_save(original, file, 4, opts);
+    assert(written == reference_bytes);
+    {
+        // defer every payload: the file ends with a hole filled by a deferred write
+        essentials::parallel_saver s(file, 3, opts, 1);
+        s.visit(original);
+        s.write_header(essentials::layout_hash(original));
+        s.write_deferred();
+        assert(s.bytes() == reference_bytes);
+    }
+    assert(essentials::file_size(file) == reference_bytes);
+
+    std::ifstream a(file, std::ios::binary), b(reference_file, std::ios::binary);
+    assert(std::equal(std::istreambuf_iterator<char>(a), std::istreambuf_iterator<char>(),
+                      std::istreambuf_iterator<char>(b)));
+
+    opts.verify_checksum = true;
+    MappedStruct s;
+    essentials::load(s, file, opts);
+    assert(s.payload[999999] == 1000012 && s.nested[9][99] == 7);
+
+    (void)written;
+    (void)reference_bytes;
+    std::remove(file);
+    std::remove(reference_file);
+}
+
+void test_async_saver() {
+    const char* file = "test_async_saver.bin";
+    const char* reference_file = "test_async_saver_reference.bin";
+    auto read_file = [](char const* filename) {
+        std::ifstream in(filename, std::ios::binary);
+        return std::vector<char>(std::istreambuf_iterator<char>(in),
+                                 std::istreambuf_iterator<char>());
+    };
+
+    MappedStruct original;
+    original.id = 11;
+    original.small = {4, 5, 6};
+    std::vector<uint64_t> payload(100000);
+    std::iota(payload.begin(), payload.end(), 0);
+    original.payload = std::move(payload);
+    original.nested.resize(50, std::vector<int>(100, 3));
+
+    for (bool header : {false, true}) {
+        essentials::format_options opts;
+        opts.alignment = 64;
+        opts.header = header;
+        size_t written = essentials::save(original, reference_file, opts);
+
+        // small buffers, so that the writer is handed many of them
+        essentials::async_save_options async;
+        async.num_buffers = 3;
+        async.buffer_bytes = 1000;
+        async.sync = header;
+        auto s = essentials::async_save(original, file, opts, async);
+        assert(s->wait() == written);
+        assert(s->done());
+        assert(read_file(file) == read_file(reference_file));
+        (void)written;
+    }
+
+    {
+        // the saved data can be modified before the writes complete
+        essentials::format_options opts;
+        opts.header = true;
+        essentials::save(original, reference_file, opts);
+        MappedStruct copy = original;
+        auto s = essentials::async_save(copy, file, opts);
+        copy.payload = std::vector<uint64_t>(10, 0);
+        copy.nested.clear();
+        s->wait();
+        assert(read_file(file) == read_file(reference_file));
+
+        MappedStruct loaded;
+        essentials::load(loaded, file, opts);
+        assert(loaded.id == 11 && loaded.nested == original.nested);
+        assert(std::equal(loaded.payload.begin(), loaded.payload.end(),
+                          original.payload.begin(), original.payload.end()));
+    }
+
+    {
+        // a saver destroyed before close() leaves the previous file in place
+        auto before = read_file(file);
+        {
+            essentials::async_saver s(file);
+            s.visit(uint64_t(42));
+            s.flush();
+        }
+        assert(read_file(file) == before);
+
+        // and no temporary file behind
+        size_t temp_files = 0;
+        DIR* dir = opendir(".");
+        while (dirent* entry = readdir(dir)) {
+            if (std::string(entry->d_name).rfind(std::string(file) + ".tmp.", 0) == 0) {
+                ++temp_files;
+            }
+        }
+        closedir(dir);
+        assert(temp_files == 0);
+        (void)temp_files;
+    }
+
+    ASSERT_THROWS(essentials::async_saver("no_such_directory/file.bin"), std::runtime_error);
+
+    std::remove(file);
+    std::remove(reference_file);
+}
+
+struct ArenaStruct {
+    uint8_t tag = 0;
+    std::vector<uint16_t, essentials::allocator<uint16_t>> shorts;
+    std::vector<uint64_t, essentials::allocator<uint64_t>> longs;
+    std::vector<std::vector<uint32_t>> nested;
+    essentials::owning_span<double> span;
+
+    essentials::contiguous_memory_allocator& get_allocator() { return m_allocator; }
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) {
+        visitor.visit(tag);
+        visitor.visit(shorts);
+        visitor.visit(longs);
+        visitor.visit(nested);
+        visitor.visit(span);
+    }
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) const {
+        visitor.visit(tag);
+        visitor.visit(shorts);
+        visitor.visit(longs);
+        visitor.visit(nested);
+        visitor.visit(span);
+    }
+
+private:
+    essentials::contiguous_memory_allocator m_allocator;
+};
+
+void test_contiguous_arena() {
+    const char* file = "test_contiguous_arena.bin";
+
+    essentials::format_options opts;
+    opts.header = true;
+    opts.alignment = 16;
+    opts.verify_checksum = true;
+
+    auto save_with = [&](essentials::format_options const& o) {
+        ArenaStruct s;
+        s.tag = 1;
+        s.shorts = {1, 2, 3};  // leaves longs misaligned unless the arena pads
+        for (uint64_t i = 0; i != 1000; ++i) s.longs.push_back(i * i);
+        s.nested = {{1, 2}, {3}};
+        s.span = std::vector<double>{0.5, 1.5};
+        return essentials::save(s, file, o);
+    };
+    size_t written = save_with(opts);
+    const size_t arena_bytes = 3 * sizeof(uint16_t) + 2 + 1000 * sizeof(uint64_t) +
+                               3 * sizeof(uint32_t) + 4 + 2 * sizeof(double);
+
+    essentials::contiguous_memory_allocator::arena_options arena;
+    arena.huge_pages = true;
+    arena.numa_node = 0;
+
+    auto check = [&](ArenaStruct& s) {
+        auto& a = s.get_allocator();
+        assert(a.size() == arena_bytes);
+        assert(a.end() == a.begin() + a.size());
+        assert(reinterpret_cast<uint8_t*>(s.longs.data()) >= a.begin());
+        assert(reinterpret_cast<uint8_t*>(s.longs.data() + 1000) <= a.end());
+        assert(reinterpret_cast<uintptr_t>(s.longs.data()) % alignof(uint64_t) == 0);
+        assert(reinterpret_cast<uint8_t const*>(s.span.data()) + 2 * sizeof(double) == a.end());
+        assert(s.tag == 1 && s.shorts[2] == 3 && s.longs[999] == 999 * 999);
+        assert(s.nested[0][1] == 2 && s.nested[1][0] == 3);
+        assert(s.span[1] == 1.5);
+        (void)a;
+    };
+
+    {
+        // the arena size is read from the header
+        ArenaStruct s;
+        assert(essentials::load_with_custom_memory_allocation(s, file, opts, arena) == written);
+        check(s);
+    }
+
+    {
+        // no header: the arena size is computed by a prescan
+        opts.header = false;
+        written = save_with(opts);
+        ArenaStruct s;
+        assert(essentials::load_with_custom_memory_allocation(s, file, opts) == written);
+        check(s);
+    }
+
+    (void)written;
+    (void)arena_bytes;
+    std::remove(file);
+}
+
+void test_direct_io() {
+    const char* file = "test_direct_io.bin";
+    const size_t alignment = essentials::direct_io_alignment;
+
+    // O_DIRECT is not supported by all file systems: the data must round-trip anyway
+    auto direct_supported = [&]() {
+        int fd = ::open(file, O_RDONLY | O_DIRECT);
+        if (fd != -1) ::close(fd);
+        return fd != -1;
+    };
+
+    {
+        // an unaligned file size, so that reads at its end are short
+        std::vector<char> bytes(3 * essentials::MiB + 123);
+        essentials::uniform_int_rng<uint64_t> rng(0, 255, 13);
+        for (auto& b : bytes) b = char(rng.gen());
+        std::ofstream out(file, std::ios::binary);
+        out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        out.close();
+
+        essentials::pread_file f(file, true);
+        assert(f.direct() == direct_supported());
+        std::unique_ptr<char, decltype(&std::free)> buffer(
+            static_cast<char*>(std::aligned_alloc(alignment, 3 * essentials::MiB + 2 * alignment)),
+            &std::free);
+        auto check = [&](size_t dest_shift, uint64_t offset, uint64_t num_bytes) {
+            char* dest = buffer.get() + dest_shift;
+            std::memset(dest, 0, num_bytes);
+            f.read({{dest, offset, num_bytes}}, 2);
+            assert(std::equal(dest, dest + num_bytes, bytes.begin() + offset));
+            (void)dest;
+        };
+        check(0, 0, bytes.size());                  // aligned destination
+        check(0, alignment, 2 * essentials::MiB);   // straight into the destination
+        check(7, 0, bytes.size());                  // through the bounce buffer only
+        check(alignment - 1, 1, bytes.size() - 1);  // aligned middle, unaligned ends
+        check(3, 5000, 1);                          // within a single block
+        check(0, bytes.size() - 10, 10);            // tail of the file
+        char c;
+        ASSERT_THROWS(f.read({{&c, bytes.size(), 1}}, 1), std::runtime_error);
+
+        // reads rejected with EINVAL (here, because of a misaligned bounce buffer)
+        // fall back to buffered reads
+        int fd = ::open(file, O_RDONLY | (direct_supported() ? O_DIRECT : 0));
+        int buffered_fd = ::open(file, O_RDONLY);
+        char* dest = buffer.get() + 7;
+        std::memset(dest, 0, bytes.size() - 100);
+        essentials::pread_direct(fd, buffered_fd, dest, bytes.size() - 100, 100,
+                                 buffer.get() + 1, alignment);
+        assert(std::equal(dest, dest + bytes.size() - 100, bytes.begin() + 100));
+        ::close(fd);
+        ::close(buffered_fd);
+        (void)dest;
+    }
+
+    {
+        MappedStruct original;
+        original.id = 3;
+        std::vector<uint64_t> payload(1000000);
+        std::iota(payload.begin(), payload.end(), 0);
+        original.payload = std::move(payload);
+        original.nested.resize(10, std::vector<int>(1000, 7));
+        essentials::format_options opts;
+        opts.header = true;
+        size_t written = essentials::save(original, file, opts);
+
+        MappedStruct s;
+        assert(essentials::parallel_load(s, file, 3, opts, true) == written);
+        assert(s.id == 3 && s.nested == original.nested);
+        assert(std::equal(s.payload.begin(), s.payload.end(), original.payload.begin()));
+
+        essentials::parallel_loader l(file, 2, opts, 1, true);
+        assert(l.direct_io() == direct_supported());
+        (void)written;
+    }
+
+    {
+        ArenaStruct original;
+        original.tag = 9;
+        original.shorts = {1, 2, 3};
+        for (uint64_t i = 0; i != 300000; ++i) original.longs.push_back(i * i + 12345);
+        original.nested = {{1, 2}, {3}};
+        original.span = std::vector<double>{0.5, 1.5};
+        essentials::format_options opts;
+        opts.header = true;
+        opts.alignment = 8;
+        size_t written = essentials::save(original, file, opts);
+
+        // every array of the arena is read with pread()
+        essentials::contiguous_memory_allocator::io_options io;
+        io.num_threads = 2;
+        io.min_parallel_bytes = 1;
+        io.direct = true;
+        ArenaStruct s;
+        assert(essentials::load_with_custom_memory_allocation(s, file, opts, {}, io) == written);
+        assert(s.get_allocator().direct_io() == direct_supported());
+        assert(s.tag == 9 && s.shorts[2] == 3 && s.longs == original.longs);
+        assert(s.nested[1][0] == 3 && s.span[1] == 1.5);
+
+        // the large array is placed to be read straight into the arena
+        std::ifstream in(file, std::ios::binary);
+        std::vector<char> contents((std::istreambuf_iterator<char>(in)),
+                                   std::istreambuf_iterator<char>());
+        auto const* longs = reinterpret_cast<char const*>(original.longs.data());
+        size_t offset = std::search(contents.begin(), contents.end(), longs, longs + 64) -
+                        contents.begin();
+        size_t arena_offset = reinterpret_cast<uint8_t*>(s.longs.data()) -
+                              s.get_allocator().begin();
+        assert(offset < contents.size() && arena_offset % alignment == offset % alignment);
+        (void)offset, (void)arena_offset;
+
+        // verifying the checksum reads sequentially
+        opts.verify_checksum = true;
+        ArenaStruct t;
+        assert(essentials::load_with_custom_memory_allocation(t, file, opts, {}, io) == written);
+        assert(!t.get_allocator().direct_io());
+        assert(t.longs == s.longs);
+        (void)written;
+    }
+
+    std::remove(file);
+}
+
+struct CompressedStruct {
+    std::vector<uint64_t> ids;
+    essentials::owning_span<int32_t> deltas;
+    std::vector<uint8_t> bytes;
+    std::vector<int64_t> extremes;
+    std::vector<double> doubles;
+    std::vector<std::vector<uint16_t>> nested;
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) {
+        visitor.visit(ids);
+        visitor.visit(deltas);
+        visitor.visit(bytes);
+        visitor.visit(extremes);
+        visitor.visit(doubles);
+        visitor.visit(nested);
+    }
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) const {
+        visitor.visit(ids);
+        visitor.visit(deltas);
+        visitor.visit(bytes);
+        visitor.visit(extremes);
+        visitor.visit(doubles);
+        visitor.visit(nested);
+    }
+
+    bool operator==(CompressedStruct const& other) const {
+        return ids == other.ids &&
+               std::equal(deltas.begin(), deltas.end(), other.deltas.begin(),
+                          other.deltas.end()) &&
+               bytes == other.bytes && extremes == other.extremes && doubles == other.doubles &&
+               nested == other.nested;
+    }
+};
+
+void test_compressed_format() {
+    const char* file = "test_compressed_format.bin";
+
+    CompressedStruct original;
+    essentials::uniform_int_rng<uint64_t> rng(0, 1000, 7);
+    original.ids.resize(100003);  // not a multiple of the block size
+    for (size_t i = 0, id = 1ULL << 40; i != original.ids.size(); ++i) {
+        original.ids[i] = id += rng.gen();
+    }
+    std::vector<int32_t> deltas(5000);
+    for (size_t i = 0; i != deltas.size(); ++i) deltas[i] = int32_t(rng.gen()) - 500;
+    original.deltas = std::move(deltas);
+    original.bytes.assign(1000, 255);  // constant blocks
+    original.bytes[500] = 0;
+    for (size_t i = 0; i != 300; ++i) {
+        original.extremes.push_back(i % 2 ? std::numeric_limits<int64_t>::max()
+                                          : std::numeric_limits<int64_t>::min());
+    }
+    original.doubles = {0.5, -1.25};
+    original.nested = {{}, {7}, {1, 2, 3}};
+
+    essentials::format_options opts;
+    opts.compress = true;
+    opts.header = true;
+    opts.verify_checksum = true;
+    opts.alignment = 16;
+
+    size_t raw = essentials::save(original, file);
+    size_t written = essentials::save(original, file, opts);
+    assert(written == essentials::file_size(file));
+    assert(written < raw / 3);
+    std::stringstream ss;
+    assert(essentials::print_size(original, ss, opts) == written);
+
+    {
+        // compression is recorded in the header
+        essentials::format_options read_opts;
+        read_opts.header = true;
+        read_opts.verify_checksum = true;
+        CompressedStruct s;
+        assert(essentials::load(s, file, read_opts) == written);
+        assert(s == original);
+        CompressedStruct p;
+        essentials::parallel_loader l(file, 4, read_opts, 1);
+        l.visit(p);
+        l.read_deferred();
+        assert(p == original);
+        CompressedStruct m;
+        assert(essentials::mmap(m, file, read_opts) == written);
+        assert(m == original);
+    }
+
+    {
+        // without header, the same options must be used
+        opts.header = false;
+        written = essentials::save(original, file, opts);
+        CompressedStruct s;
+        assert(essentials::load(s, file, opts) == written);
+        assert(s == original);
+    }
+
+    {
+        // decoding into the arena of a contiguous_memory_allocator
+        ArenaStruct arena;
+        arena.shorts.assign(original.bytes.begin(), original.bytes.end());
+        arena.longs = {original.ids.begin(), original.ids.end()};
+        arena.nested = {{1, 2}, {3}};
+        arena.span = std::vector<double>{1.5};
+        for (bool header : {false, true}) {
+            opts.header = header;
+            written = essentials::save(arena, file, opts);
+            ArenaStruct a;
+            assert(essentials::load_with_custom_memory_allocation(a, file, opts) == written);
+            assert(a.shorts == arena.shorts && a.longs == arena.longs);
+            assert(a.nested == arena.nested && a.span[0] == 1.5);
+            assert(a.get_allocator().size() >= arena.longs.size() * sizeof(uint64_t));
+        }
+    }
+
+    {
+        // parallel decoding
+        std::vector<uint32_t> values(1000000);
+        std::iota(values.begin(), values.end(), 0);
+        std::vector<uint8_t> encoded;
+        essentials::block_codec::encode(values.data(), values.size(), encoded);
+        assert(encoded.size() == essentials::block_codec::encoded_bytes(values.data(), values.size()));
+        std::vector<uint32_t> decoded(values.size());
+        essentials::block_codec::decode(encoded.data(), encoded.size(), decoded.data(),
+                                        decoded.size(), 4);
+        assert(decoded == values);
+        encoded.resize(encoded.size() / 2);
+        ASSERT_THROWS(essentials::block_codec::decode(encoded.data(), encoded.size(),
+                                                      decoded.data(), decoded.size()),
+                      std::runtime_error);
+    }
+
+    (void)raw, (void)written;
+    std::remove(file);
+}
+
+struct LazyStruct {
+    uint32_t id = 0;
+    essentials::compressed_span<uint64_t> ids;
+    std::vector<uint32_t> other;
+
+    essentials::contiguous_memory_allocator& get_allocator() { return m_allocator; }
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) {
+        visitor.visit(id);
+        visitor.visit(ids);
+        visitor.visit(other);
+    }
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) const {
+        visitor.visit(id);
+        visitor.visit(ids);
+        visitor.visit(other);
+    }
+
+private:
+    essentials::contiguous_memory_allocator m_allocator;
+};
+
+void test_compressed_span() {
+    const char* file = "test_compressed_span.bin";
+
+    std::vector<uint64_t> values(100000);
+    essentials::uniform_int_rng<uint64_t> rng(0, 100, 3);
+    for (size_t i = 1; i != values.size(); ++i) values[i] = values[i - 1] + rng.gen();
+
+    LazyStruct original;
+    original.id = 3;
+    original.ids = essentials::compressed_span<uint64_t>(values, 8);
+    original.other = {4, 5};
+    auto const& ids = original.ids;
+    assert(ids.size() == values.size());
+    assert(ids.encoded_bytes() < values.size() * sizeof(uint64_t) / 4);
+    assert(ids[0] == values[0] && ids[12345] == values[12345] && ids.back() == values.back());
+    assert(std::equal(ids.begin(), ids.end(), values.begin(), values.end()));
+
+    // the cache holds at most 8 blocks
+    size_t misses = ids.cache_misses();
+    for (size_t i = 0; i != 16; ++i) (void)ids[i * essentials::block_codec::block_size];
+    for (size_t i = 0; i != 16; ++i) (void)ids[i * essentials::block_codec::block_size];
+    assert(ids.cache_misses() == misses + 32);
+    (void)ids[15 * essentials::block_codec::block_size + 1];
+    assert(ids.cache_hits() > 0);
+
+    std::vector<size_t> indices;
+    for (size_t i = 0; i != 1000; ++i) indices.push_back(rng.gen() * 997 % values.size());
+    auto gathered = ids.gather(indices);
+    for (size_t i = 0; i != indices.size(); ++i) assert(gathered[i] == values[indices[i]]);
+
+    {
+        // concurrent random accesses through a small cache
+        std::vector<std::thread> threads;
+        std::atomic<size_t> errors(0);
+        for (size_t t = 0; t != 4; ++t) {
+            threads.emplace_back([&, t]() {
+                essentials::uniform_int_rng<size_t> r(0, values.size() - 1, t);
+                for (size_t i = 0; i != 10000; ++i) {
+                    size_t j = r.gen();
+                    if (ids[j] != values[j]) ++errors;
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        assert(errors == 0);
+    }
+
+    essentials::format_options opts;
+    opts.header = true;
+    opts.alignment = 8;
+    size_t written = essentials::save(original, file, opts);
+    std::stringstream ss;
+    assert(essentials::print_size(original, ss, opts) == written);
+
+    auto check = [&](LazyStruct const& s) {
+        assert(s.id == 3 && s.other == original.other);
+        assert(std::equal(s.ids.begin(), s.ids.end(), values.begin(), values.end()));
+        assert(s.ids[777] == values[777]);
+        (void)s;
+    };
+    {
+        LazyStruct s;
+        assert(essentials::load(s, file, opts) == written);
+        check(s);
+    }
+    {
+        LazyStruct m;
+        auto region = std::make_shared<essentials::mapped_region>(file);
+        assert(essentials::mmap(m, region, opts) == written);
+        auto* begin = static_cast<uint8_t const*>(region->data());
+        assert(m.ids.encoded() > begin && m.ids.encoded() < begin + written);
+        check(m);
+        (void)begin;
+    }
+    {
+        LazyStruct a;
+        assert(essentials::load_with_custom_memory_allocation(a, file, opts) == written);
+        assert(a.ids.encoded() >= a.get_allocator().begin() &&
+               a.ids.encoded() < a.get_allocator().end());
+        check(a);
+    }
+
+    {
+        // a corrupt size or encoding length is rejected before any access or allocation
+        uint8_t table[8] = {0};
+        ASSERT_THROWS(essentials::compressed_span<uint64_t>(table, 8, size_t(-1)),
+                      std::runtime_error);
+        essentials::format_options plain;
+        auto corrupt = [&](std::streamoff pos, uint64_t value) {
+            essentials::save(original, file, plain);
+            std::fstream f(file, std::ios::binary | std::ios::in | std::ios::out);
+            f.seekp(pos);  // id, then the size and the encoding length of ids
+            f.write(reinterpret_cast<char const*>(&value), sizeof(value));
+        };
+        for (auto [pos, value] : {std::pair<std::streamoff, uint64_t>{4, uint64_t(-1)},
+                                  {12, uint64_t(1) << 60}}) {
+            corrupt(pos, value);
+            LazyStruct s, m, a;
+            ASSERT_THROWS(essentials::load(s, file, plain), std::runtime_error);
+            ASSERT_THROWS(essentials::mmap(m, file, plain), std::runtime_error);
+            ASSERT_THROWS(essentials::load_with_custom_memory_allocation(a, file, plain),
+                          std::runtime_error);
+        }
+    }
+
+    (void)misses, (void)written, (void)check;
+    std::remove(file);
+}
+
+void test_mmap_builder() {
+    const char* built_file = "test_mmap_builder.bin";
+    const char* saved_file = "test_mmap_builder_saved.bin";
+
+    essentials::format_options opts;
+    opts.header = true;
+    opts.alignment = 8;
+
+    MappedStruct original;
+    original.id = 9;
+    original.small = {1, 2, 3};
+    std::vector<uint64_t> payload(300000);  // grows the mapping several times
+    std::iota(payload.begin(), payload.end(), 0);
+    original.payload = payload;
+    original.nested = {{4}, {}, {5, 6}};
+    size_t saved = essentials::save(original, saved_file, opts);
+
+    {
+        // visiting produces the same file as saving
+        essentials::mmap_builder builder(built_file, opts, 4096);
+        builder.visit(original);
+        assert(builder.close(essentials::layout_hash(original)) == saved);
+        std::ifstream a(saved_file, std::ios::binary), b(built_file, std::ios::binary);
+        assert(std::equal(std::istreambuf_iterator<char>(a), std::istreambuf_iterator<char>(),
+                          std::istreambuf_iterator<char>(b), std::istreambuf_iterator<char>()));
+    }
+
+    {
+        // values appended one at a time
+        essentials::mmap_builder builder(built_file, opts, 4096);
+        builder.append(original.id);
+        builder.append(original.small.data(), original.small.size());
+        auto array = builder.begin_array<uint64_t>();
+        ASSERT_THROWS(builder.append(uint32_t(0)), std::runtime_error);
+        for (uint64_t x : payload) array.push_back(x);
+        assert(array.size() == payload.size() && array.data()[1000] == 1000);
+        array.close();
+        builder.append(original.nested.size());
+        for (auto const& v : original.nested) builder.append(v.data(), v.size());
+        assert(builder.close(essentials::layout_hash(MappedStruct())) == saved);
+    }
+
+    essentials::format_options read_opts;
+    read_opts.header = true;
+    read_opts.verify_checksum = true;
+    MappedStruct m;
+    assert(essentials::mmap(m, built_file, read_opts) == saved);
+    assert(m.id == 9 && m.small == original.small && m.nested == original.nested);
+    assert(std::equal(m.payload.begin(), m.payload.end(), payload.begin(), payload.end()));
+    assert(reinterpret_cast<uintptr_t>(m.payload.data()) % 8 == 0);
+    ArenaStruct a;
+    ASSERT_THROWS(essentials::load(a, built_file, read_opts), std::runtime_error);
+
+    auto exists = [](char const* filename) { return std::ifstream(filename).good(); };
+    {
+        // an array_builder can not be used once closed or moved from
+        essentials::mmap_builder builder(built_file, opts, 4096);
+        auto array = builder.begin_array<uint32_t>();
+        array.push_back(1);
+        auto moved = std::move(array);
+        ASSERT_THROWS(array.push_back(2), std::runtime_error);
+        moved.close();
+        ASSERT_THROWS(moved.push_back(2), std::runtime_error);
+        ASSERT_THROWS(moved.append(nullptr, 0), std::runtime_error);
+        builder.close(essentials::layout_hash(uint32_t()));
+    }
+    assert(exists(built_file));
+    {
+        // a builder destroyed before close() removes its file, open arrays included
+        essentials::mmap_builder builder(built_file, opts, 4096);
+        builder.append(uint64_t(1));
+        auto array = builder.begin_array<uint64_t>();
+        array.push_back(2);
+    }
+    assert(!exists(built_file));
+    (void)exists;
+
+    (void)saved;
+    std::remove(built_file);
+    std::remove(saved_file);
+}
+
+void test_streaming_loader() {
+    const char* file = "test_streaming_loader.bin";
+
+    CompressedStruct original;
+    original.ids.resize(300000);
+    std::iota(original.ids.begin(), original.ids.end(), 100);
+    original.deltas = std::vector<int32_t>{-1, 2, -3};
+    original.bytes.assign(70000, 7);
+    original.doubles = {0.5, 1.5};
+    original.nested = {{1, 2}, {}, {3}};
+    uint64_t expected_sum = std::accumulate(original.ids.begin(), original.ids.end(), uint64_t(0));
+
+    for (bool compress : {false, true}) {
+        essentials::format_options opts;
+        opts.header = true;
+        opts.verify_checksum = true;
+        opts.alignment = 8;
+        opts.compress = compress;
+        size_t written = essentials::save(original, file, opts);
+
+        const size_t chunk_bytes = 64 * 1024;
+        uint64_t sum = 0;
+        size_t arrays = 0, values = 0, next = 0, max_chunk_bytes = 0;
+        CompressedStruct s;
+        size_t read = essentials::stream(
+            s, file,
+            [&](auto const* data, size_t n, size_t first) {
+                using T = std::remove_cv_t<std::remove_pointer_t<decltype(data)>>;
+                if (first == 0) ++arrays, next = 0;
+                assert(first == next);
+                next += n;
+                values += n;
+                max_chunk_bytes = std::max(max_chunk_bytes, n * sizeof(T));
+                if constexpr (std::is_same_v<T, uint64_t>) {
+                    sum = std::accumulate(data, data + n, sum);
+                }
+            },
+            opts, chunk_bytes);
+        assert(read == written);
+        assert(sum == expected_sum);
+        assert(arrays == 6);  // ids, deltas, bytes, doubles and the 2 non-empty nested
+        assert(values == 300000 + 3 + 70000 + 2 + 3);
+        assert(max_chunk_bytes <= chunk_bytes);
+        assert(s.ids.empty() && s.nested.empty());  // nothing is materialized
+        (void)written, (void)read;
+    }
+
+    (void)expected_sum;
+    std::remove(file);
+}
+
+/* The serialized layout of a jagged_span<uint32_t>, to write corrupt ones. */
+struct RawJaggedSpan {
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> values;
+
+    template <typename Visitor>
+    void visit(Visitor& visitor) const {
+        visitor.visit(offsets);
+        visitor.visit(values);
+    }
+};
+
+void test_jagged_span() {
+    const char* file = "test_jagged_span.bin";
+
+    std::vector<std::vector<uint32_t>> arrays(10000);
+    for (size_t i = 0; i != arrays.size(); ++i) {
+        arrays[i].resize(i % 7);
+        std::iota(arrays[i].begin(), arrays[i].end(), uint32_t(i));
+    }
+    essentials::jagged_span<uint32_t> original(arrays);
+    assert(original.size() == arrays.size());
+    assert(original.values().size() == 29994);  // sum of i % 7 for i < 10000
+    size_t i = 0;
+    for (auto a : original) {
+        assert(std::equal(a.begin(), a.end(), arrays[i].begin(), arrays[i].end()));
+        ++i;
+    }
+
+    essentials::jagged_span<uint32_t>::builder b;
+    b.push_back(arrays[3]);
+    b.push_back(arrays[0]);
+    essentials::jagged_span<uint32_t> small;
+    b.build(small);
+    assert(small.size() == 2 && small[0].size() == 3 && small[0][2] == 5 && small[1].empty());
+
+    essentials::format_options opts;
+    opts.header = true;
+    opts.alignment = 8;
+    size_t written = essentials::save(original, file, opts);
+    std::stringstream ss;
+    assert(essentials::print_size(original, ss, opts) == written);
+
+    {
+        essentials::jagged_span<uint32_t> m;
+        auto region = std::make_shared<essentials::mapped_region>(file);
+        assert(essentials::mmap(m, region, opts) == written);
+        auto* begin = reinterpret_cast<uint32_t const*>(region->data());
+        auto* end = reinterpret_cast<uint32_t const*>(region->data() + written);
+        assert(m.size() == arrays.size());
+        for (size_t j = 0; j != m.size(); ++j) {
+            auto a = m[j];
+            assert(a.empty() || (a.data() > begin && a.data() + a.size() <= end));
+            assert(std::equal(a.begin(), a.end(), arrays[j].begin(), arrays[j].end()));
+        }
+        (void)begin, (void)end;
+    }
+    {
+        essentials::jagged_span<uint32_t> l;
+        assert(essentials::load(l, file, opts) == written);
+        assert(l.size() == arrays.size() && l[13][5] == 13 + 5);
+    }
+
+    {
+        // corrupt offsets are rejected, whether mapped or loaded
+        std::vector<std::vector<uint64_t>> corrupt = {
+            {1, 3},        // not starting at 0
+            {0, 3, 1, 3},  // decreasing
+            {0, 2},        // not ending at the number of values
+            {},            // no offsets, but values
+        };
+        for (auto const& offsets : corrupt) {
+            essentials::save(RawJaggedSpan{offsets, {1, 2, 3}}, file);
+            essentials::jagged_span<uint32_t> m;
+            ASSERT_THROWS(essentials::mmap(m, file), std::runtime_error);
+            ASSERT_THROWS(essentials::load(m, file), std::runtime_error);
+        }
+        essentials::save(RawJaggedSpan{{0, 3, 3}, {1, 2, 3}}, file);
+        essentials::jagged_span<uint32_t> m;
+        essentials::load(m, file);
+        assert(m.size() == 2 && m[0].size() == 3 && m[1].empty());
+    }
+
+    (void)i, (void)written;
+    std::remove(file);
+}
+
+void test_mmap_options() {
+    const char* file = "test_mmap_options.bin";
+
+    MappedStruct original;
+    original.id = 21;
+    std::vector<uint64_t> payload(100000);
+    std::iota(payload.begin(), payload.end(), 0);
+    original.payload = std::move(payload);
+    size_t written = essentials::save(original, file);
+
+    essentials::mmap_options mopts;
+    mopts.populate = true;
+    mopts.will_need = true;
+    mopts.advice = MADV_RANDOM;
+    mopts.huge_pages = true;
+
+    {
+        MappedStruct s;
+        assert(essentials::mmap(s, file, {}, mopts) == written);
+        assert(s.payload[99999] == 99999);
+        assert(essentials::advise(s.payload, MADV_SEQUENTIAL));
+    }
+
+    {
+        // two structures sharing one region, which outlives the caller's pointer
+        auto region = std::make_shared<essentials::mapped_region>(file);
+        region->warm_up();
+        MappedStruct s1, s2;
+        assert(essentials::mmap(s1, region) == written);
+        assert(essentials::mmap(s2, region) == written);
+        assert(s1.payload.data() == s2.payload.data());
+        assert(reinterpret_cast<uint8_t const*>(s1.payload.data()) > region->data());
+        assert(region->advise(s1.payload.data(), 8 * 100000, MADV_WILLNEED));
+        assert(!region->advise(region->data() + region->size(), 10, MADV_WILLNEED));
+        region.reset();
+        assert(s2.payload[12345] == 12345);
+    }
+
+    {
+        // residency: a populated mapping is fully resident
+        mopts.advice = MADV_NORMAL;
+        auto region = std::make_shared<essentials::mapped_region>(file, mopts);
+        assert(region->resident_fraction() == 1.0);
+        assert(region->resident_bytes() == region->size());
+        MappedStruct s;
+        essentials::mmap(s, region);
+        assert(essentials::resident_fraction(s.payload) == 1.0);
+        // mlock may be forbidden by RLIMIT_MEMLOCK: just check it does not break anything
+        if (essentials::lock(s.payload)) assert(essentials::unlock(s.payload));
+        if (region->lock()) assert(region->unlock());
+        assert(!region->lock(region->data() + region->size(), 1));
+
+        essentials::json_lines jl;
+        region->add_to(jl);
+        const char* json_file = "test_mmap_options.jsonl";
+        jl.save_to_file(json_file);
+        std::ifstream in(json_file);
+        std::string line;
+        std::getline(in, line);
+        assert(line.find("\"mmap_resident_fraction\": \"1.0") != std::string::npos);
+        std::remove(json_file);
+    }
+
+    (void)written;
+    std::remove(file);
+}
+
+void test_sizer_aggregate() {
+    std::vector<MappedStruct> records(1000);
+    for (size_t i = 0; i != records.size(); ++i) {
+        records[i].id = i;
+        records[i].small.resize(i % 10);
+        records[i].nested.resize(2, std::vector<int>(i % 3));
+    }
+    essentials::sizer full("records");
+    essentials::sizer aggregated("records", {}, true);
+    full.visit(records);
+    aggregated.visit(records);
+    assert(full.bytes() == aggregated.bytes());
+    assert(full.root().children.size() == records.size());
+
+    // one node per type, with per-element statistics
+    assert(aggregated.root().children.size() == 1);
+    auto const& record = aggregated.root().children.front();
+    assert(record.count == records.size());
+    size_t min_bytes = full.bytes(), max_bytes = 0;
+    for (auto const& child : full.root().children) {
+        min_bytes = std::min(min_bytes, child.bytes);
+        max_bytes = std::max(max_bytes, child.bytes);
+    }
+    assert(record.min_bytes == min_bytes && record.max_bytes == max_bytes);
+    assert(record.children.size() == 4);
+    auto const& nested = record.children[3];  // the std::vector<int> elements of all records
+    assert(nested.count == 2 * records.size());
+
+    std::stringstream ss;
+    aggregated.print(ss);
+    assert(ss.str().find("count = 1000") != std::string::npos);
+    (void)min_bytes, (void)max_bytes, (void)record, (void)nested;
+}
+
+void test_sizer_export() {
+    std::vector<MappedStruct> records(10);
+    for (size_t i = 0; i != records.size(); ++i) records[i].small.resize(i);
+    essentials::sizer s("records", {}, true);
+    s.visit(records);
+
+    char const* filename = "./sizer_export.jsonl";
+    essentials::json_lines jl;
+    s.add_to(jl);
+    jl.save_to_file(filename);
+    std::ifstream json(filename);
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(json, line);) lines.push_back(line);
+    json.close();
+    std::remove(filename);
+    assert(lines.size() == 6);  // records, MappedStruct and its 4 members
+    assert(lines[0].find("\"path\": \"records\"") != std::string::npos);
+    // type names are spelled as the sizer demangles them, which depends on the library
+    std::string path = "records/" + essentials::demangle(typeid(MappedStruct).name()) + "[0]/" +
+                       essentials::demangle(typeid(std::vector<uint16_t>).name()) + "[1]";
+    assert(lines[3].find("\"path\": \"" + path + "\"") != std::string::npos);
+    assert(lines[3].find("\"elements\": \"45\"") != std::string::npos);
+
+    std::stringstream folded;
+    s.print_folded(folded);
+    size_t total = 0;
+    for (std::string line; std::getline(folded, line);) {
+        assert(line.find("records") == 0);
+        total += std::stoull(line.substr(line.rfind(' ') + 1));
+    }
+    assert(total == s.bytes());
+    (void)total, (void)path;
+}
+
 void test_allocator_exceptions() {
     // Test the contiguous_memory_allocator boundary checks
     // We will spoof a visitor by passing a small dummy buffer
@@ -213,8 +1771,31 @@ int main() {
 
     RUN_TEST(test_type_traits);
     RUN_TEST(test_advanced_timer);
+    RUN_TEST(test_timer_statistics);
+    RUN_TEST(test_perf_timer);
+    RUN_TEST(test_tsc_timer);
+    RUN_TEST(test_streaming_timer);
+    RUN_TEST(test_latency_recorder);
+    RUN_TEST(test_json_lines_writer);
+    RUN_TEST(test_async_logger);
     RUN_TEST(test_owning_span_models);
     RUN_TEST(test_serialization_edge_cases);
+    RUN_TEST(test_mmap_loader);
+    RUN_TEST(test_aligned_format);
+    RUN_TEST(test_file_header);
+    RUN_TEST(test_parallel_load);
+    RUN_TEST(test_parallel_save);
+    RUN_TEST(test_async_saver);
+    RUN_TEST(test_contiguous_arena);
+    RUN_TEST(test_direct_io);
+    RUN_TEST(test_compressed_format);
+    RUN_TEST(test_compressed_span);
+    RUN_TEST(test_mmap_builder);
+    RUN_TEST(test_streaming_loader);
+    RUN_TEST(test_jagged_span);
+    RUN_TEST(test_mmap_options);
+    RUN_TEST(test_sizer_aggregate);
+    RUN_TEST(test_sizer_export);
     RUN_TEST(test_allocator_exceptions);
     RUN_TEST(test_json_lines_edge_cases);
 
@@ -63,6 +63,20 @@ int main() {
     std::cout << "\tMean per query: " << avg / m << " [musec]";
     std::cout << std::endl;
 
+    // let a benchmark choose the number of runs and report the distribution
+    benchmark_options opts;
+    opts.max_seconds = 2.0;
+    benchmark<clock_type, std::chrono::nanoseconds> b(opts);
+    auto const& stats = b.run([&]() {
+        for (auto i : queries) do_not_optimize_away(sequence[i]);
+    });
+    std::cout << "\tMedian per query: " << stats.median / m << " [nanosec] (p99 = " << stats.p99 / m
+              << ", runs = " << stats.runs << ")" << std::endl;
+
+    json_lines jl;
+    b.add_to(jl);
+    jl.print_line();
+
     std::cout << "max resident set size: " << essentials::maxrss_in_bytes() << " bytes\n";
 
     return 0;